@@ -0,0 +1,133 @@
+/*************************************************
+
+  Shared-memory stats board of the Zydis fuzzer.
+
+  Copyright (C) 2021  Dr. Tremalrik
+
+  Distributed under the MIT licence.
+
+*************************************************/
+
+// Every fuzzer process started with --board publishes its
+// counters in a POSIX shared-memory segment named
+// /zydis-fuzz-<pid>, one slot per fuzzing thread. Slots are
+// seqlock-protected: the writer makes the sequence number
+// odd, updates the slot and makes it even again, and a
+// reader retries until it sees the same even number before
+// and after copying. zydis_fuzz_top reads all boards on the
+// host. No Zydis headers are needed here, so that the
+// monitor builds without the library.
+
+#ifndef ZYDIS_FUZZ_BOARD_H
+#define ZYDIS_FUZZ_BOARD_H
+
+#include <cstdint>
+#include <cstring>
+
+#define BOARD_NAME_PREFIX "/zydis-fuzz-"
+#define BOARD_MAGIC 0x5A594642u     // "ZYFB"
+#define BOARD_VERSION 2
+#define BOARD_SLOTS 64
+
+
+// Decode status histogram. The Zydis failure codes 0x00 to
+// 0x0C (NO_MORE_DATA to IMPOSSIBLE_INSTRUCTION) get a bucket
+// each, in code order. 0x0B is SKIP_TOKEN, a success code
+// that a failing decode cannot return, so it counts as
+// "other" like any unknown code.
+
+#define BOARD_STATUS_BUCKETS 16
+#define BOARD_ZYDIS_CODES 13
+#define BOARD_SKIP_TOKEN 0x0B
+
+static const char* const board_status_names[BOARD_STATUS_BUCKETS] = {
+    "success",
+    "no more data",
+    "decoding error",
+    "instruction too long",
+    "bad register",
+    "illegal lock",
+    "illegal legacy prefix",
+    "illegal rex",
+    "invalid map",
+    "malformed evex",
+    "malformed mvex",
+    "invalid mask",
+    "impossible instruction",
+    "other zydis error",
+    "other error",
+    "unused"
+};
+
+static inline int board_status_bucket( uint32_t status ) {
+    if( !(status & 0x80000000u) )
+        return 0;
+    if( ((status >> 20) & 0x7FFu) != 2 )   // ZYAN_MODULE_ZYDIS
+        return 14;
+    uint32_t code = status & 0xFFFFFu;
+    if( code >= BOARD_ZYDIS_CODES || code == BOARD_SKIP_TOKEN )
+        return 13;
+    return code < BOARD_SKIP_TOKEN ? 1 + (int)code : (int)code;
+}
+
+
+enum board_state {
+    BOARD_RUNNING  = 1,
+    BOARD_FINISHED = 2,
+    BOARD_CRASHED  = 3
+};
+
+
+struct board_slot {
+    alignas(64) uint64_t seq;
+    uint32_t in_use;
+    uint32_t pad;
+    uint64_t updated_ns;        // CLOCK_MONOTONIC of the last publish
+    uint64_t iterations;
+    uint64_t findings;          // invariant violations and crashes
+    uint64_t status_counts[BOARD_STATUS_BUCKETS];
+};
+
+
+struct board_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    uint32_t state;             // board_state
+    uint64_t start_ns;          // CLOCK_MONOTONIC at startup
+    char mode[32];
+    uint32_t slot_count;        // slots handed out so far
+    uint32_t pad;
+    board_slot slots[BOARD_SLOTS];
+};
+
+
+static inline void board_slot_begin( board_slot* slot ) {
+    __atomic_store_n( &slot->seq, slot->seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+
+static inline void board_slot_end( board_slot* slot ) {
+    __atomic_store_n( &slot->seq, slot->seq + 1, __ATOMIC_RELEASE );
+}
+
+
+// Consistent copy of a slot. Returns false if the writer kept
+// it busy for all retries, e.g. because it died mid-update.
+
+static inline bool board_slot_read( const board_slot* slot, board_slot* out ) {
+    int tries;
+    for( tries=0; tries<1000; tries++ ) {
+        uint64_t seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+        if( seq & 1 )
+            continue;
+        memcpy( out, (const void*)slot, sizeof(*out) );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &slot->seq, __ATOMIC_RELAXED ) == seq )
+            return true;
+    }
+    return false;
+}
+
+#endif
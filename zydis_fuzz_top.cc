@@ -0,0 +1,231 @@
+/*************************************************
+
+  Live monitor for Zydis fuzzer processes.
+
+  Copyright (C) 2021  Dr. Tremalrik
+
+  Distributed under the MIT licence.
+
+*************************************************/
+
+// Aggregates the stats boards of all fuzzer processes on
+// this host that run with --board. Rates are computed from
+// the difference between two refreshes.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "zydis_fuzz_board.h"
+
+#define MAX_INSTANCES 1024
+
+
+struct instance {
+    int pid;
+    uint64_t iterations;
+    uint64_t sampled_ns;
+};
+
+instance previous[MAX_INSTANCES];
+int previous_count = 0;
+
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// Board segments are named /zydis-fuzz-<pid>; the campaign
+// replay queues share the prefix but not the digits-only tail.
+
+int board_pid_from_name( const char* name ) {
+    const char* prefix = BOARD_NAME_PREFIX + 1;     // no leading slash in /dev/shm
+    size_t n = strlen( prefix );
+    if( strncmp( name, prefix, n ) || !name[n] )
+        return 0;
+    const char* p;
+    for( p = name + n; *p; p++ )
+        if( *p < '0' || *p > '9' )
+            return 0;
+    return atoi( name + n );
+}
+
+
+bool process_alive( int pid ) {
+    return !kill( pid, 0 ) || errno == EPERM;
+}
+
+
+const char* format_count( double v, char* buf, size_t size ) {
+    if( v >= 1e9 )      snprintf( buf, size, "%.2fG", v / 1e9 );
+    else if( v >= 1e6 ) snprintf( buf, size, "%.2fM", v / 1e6 );
+    else if( v >= 1e3 ) snprintf( buf, size, "%.1fk", v / 1e3 );
+    else                snprintf( buf, size, "%.0f", v );
+    return buf;
+}
+
+
+void refresh( bool reap ) {
+    int i, k;
+    instance current[MAX_INSTANCES];
+    int current_count = 0;
+    uint64_t totals[BOARD_STATUS_BUCKETS];
+    uint64_t total_iterations = 0, total_findings = 0;
+    double total_rate = 0;
+    int threads = 0, crashed = 0;
+    char lines[MAX_INSTANCES][160];
+    memset( totals, 0, sizeof(totals) );
+
+    DIR* dir = opendir( "/dev/shm" );
+    if( !dir ) {
+        printf("Cannot open /dev/shm: %s\n", strerror(errno) );
+        return;
+    }
+    struct dirent* entry;
+    while( (entry = readdir( dir )) && current_count < MAX_INSTANCES ) {
+        int pid = board_pid_from_name( entry->d_name );
+        if( !pid )
+            continue;
+        char name[300];
+        snprintf( name, sizeof(name), "/%s", entry->d_name );
+        int fd = shm_open( name, O_RDONLY, 0 );
+        if( fd < 0 )
+            continue;
+        void* p = mmap( NULL, sizeof(board_header), PROT_READ, MAP_SHARED, fd, 0 );
+        close( fd );
+        if( p == MAP_FAILED )
+            continue;
+        const board_header* b = (const board_header*)p;
+        if( b->magic != BOARD_MAGIC || b->version != BOARD_VERSION ) {
+            munmap( p, sizeof(board_header) );
+            continue;
+        }
+        bool alive = process_alive( pid );
+        if( reap && !alive ) {
+            munmap( p, sizeof(board_header) );
+            shm_unlink( name );
+            continue;
+        }
+
+        uint64_t iterations = 0, findings = 0, valid = 0, now = monotonic_ns();
+        int slot_count = b->slot_count < BOARD_SLOTS ? b->slot_count : BOARD_SLOTS;
+        int live_slots = 0;
+        for( i=0; i<slot_count; i++ ) {
+            board_slot s;
+            if( !b->slots[i].in_use || !board_slot_read( &b->slots[i], &s ) )
+                continue;
+            live_slots++;
+            iterations += s.iterations;
+            findings += s.findings;
+            valid += s.status_counts[0];
+            for( k=0; k<BOARD_STATUS_BUCKETS; k++ )
+                totals[k] += s.status_counts[k];
+        }
+
+        const char* state = "running";
+        if( b->state == BOARD_CRASHED )
+            state = "crashed";
+        else if( b->state == BOARD_FINISHED )
+            state = "finished";
+        else if( !alive )
+            state = "dead";
+        crashed += b->state == BOARD_CRASHED || (!alive && b->state == BOARD_RUNNING);
+
+        // rate since the previous refresh, else since startup
+        double rate = 0;
+        for( i=0; i<previous_count; i++ )
+            if( previous[i].pid == pid )
+                break;
+        if( i < previous_count && now > previous[i].sampled_ns )
+            rate = (iterations - previous[i].iterations) * 1e9 / (now - previous[i].sampled_ns);
+        else if( now > b->start_ns )
+            rate = iterations * 1e9 / (now - b->start_ns);
+        if( !alive )
+            rate = 0;
+
+        char it[32], rt[32];
+        snprintf( lines[current_count], sizeof(lines[0]), "%7d  %-18.18s %-9s %7d %12s %10s %7.1f%% %9llu",
+            pid, b->mode, state, live_slots,
+            format_count( (double)iterations, it, sizeof(it) ),
+            format_count( rate, rt, sizeof(rt) ),
+            iterations ? 100.0 * valid / iterations : 0.0,
+            (unsigned long long)findings );
+        current[current_count].pid = pid;
+        current[current_count].iterations = iterations;
+        current[current_count].sampled_ns = now;
+        current_count++;
+
+        threads += live_slots;
+        total_iterations += iterations;
+        total_findings += findings;
+        total_rate += rate;
+        munmap( p, sizeof(board_header) );
+    }
+    closedir( dir );
+
+    char tr[32], ti[32];
+    printf("zydis-fuzz-top: %d instances, %d threads, %s decodes/sec, %s decodes, %llu findings, %d crashed\n\n",
+        current_count, threads, format_count( total_rate, tr, sizeof(tr) ),
+        format_count( (double)total_iterations, ti, sizeof(ti) ),
+        (unsigned long long)total_findings, crashed );
+    printf("    PID  MODE               STATE     THREADS   ITERATIONS     RATE/s  VALID%%  FINDINGS\n");
+    for( i=0; i<current_count; i++ )
+        printf("%s\n", lines[i] );
+    printf("\nDecode status:\n");
+    for( k=0; k<BOARD_STATUS_BUCKETS; k++ )
+        if( totals[k] )
+            printf("  %-24s %14llu  %6.2f%%\n", board_status_names[k], (unsigned long long)totals[k],
+                100.0 * totals[k] / (total_iterations ? total_iterations : 1) );
+
+    memcpy( previous, current, current_count * sizeof(instance) );
+    previous_count = current_count;
+}
+
+
+void print_usage( const char* progname ) {
+    printf("Usage: %s [options]\n", progname );
+    printf("  --once           print one snapshot and exit\n");
+    printf("  --interval=S     refresh every S seconds (default 1)\n");
+    printf("  --reap           remove the boards of processes that are gone\n");
+}
+
+
+int main( int argc, char *argv[] ) {
+    int i;
+    bool once = false, reap = false;
+    double interval = 1.0;
+    for( i=1; i<argc; i++ ) {
+        if( !strcmp( argv[i], "--once" ) ) {
+            once = true;
+        } else if( !strncmp( argv[i], "--interval=", 11 ) ) {
+            interval = atof( argv[i] + 11 );
+            if( interval < 0.1 )
+                interval = 0.1;
+        } else if( !strcmp( argv[i], "--reap" ) ) {
+            reap = true;
+        } else {
+            print_usage( argv[0] );
+            return !strcmp( argv[i], "--help" ) ? 0 : EXIT_FAILURE;
+        }
+    }
+    for(;;) {
+        if( !once )
+            printf("\033[H\033[2J");
+        refresh( reap );
+        fflush(stdout);
+        if( once )
+            return 0;
+        usleep( (useconds_t)(interval * 1e6) );
+    }
+}
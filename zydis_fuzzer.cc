@@ -11,16 +11,459 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstdarg>
 #include <cstdint>
+#include <cstddef>
 #include <cstring>
 #include <csignal>
+#include <ctime>
+#include <cerrno>
+#include <climits>
+#include <csetjmp>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
 
+#if defined(__x86_64__) && defined(__linux__)
+#define HW_ORACLE_SUPPORTED 1
+#endif
+
+#include "zydis_fuzz_board.h"
+
+
+
+// ---------------------------------------------------
+//   Recorded decoder inputs. Every input is recorded
+//   before it is decoded, per thread, so that the
+//   signal handler reports the input of the faulting
+//   thread.
+//
+//   With --crash-record=PATH the record lives in a
+//   file-backed shared mapping instead, as a ring of
+//   the last CRASH_RING_ENTRIES inputs per thread. The
+//   page cache keeps it after any kind of death,
+//   SIGKILL and the OOM killer included, and
+//   --postmortem=PATH prints it afterwards. Recording
+//   into the ring costs one store of the ring count
+//   on top of the copy that is made anyway.
+// ---------------------------------------------------
+
+struct input_snapshot {
+    uint8_t bytes[16];
+    int32_t machine_mode;
+    uint32_t pad[3];
+};
+
+#define CRASH_RING_ENTRIES 8        // power of 2
+#define CRASH_RECORD_RINGS 64
+#define CRASH_RECORD_MAGIC 0x5A594352u  // "ZYCR"
+#define CRASH_RECORD_VERSION 1
+
+struct crash_ring {
+    alignas(64) uint64_t count;     // inputs recorded; the last is count-1
+    int64_t block;                  // block of the block mode, or -1
+    uint32_t in_use;
+    uint32_t pad;
+    input_snapshot entries[CRASH_RING_ENTRIES];
+};
+
+struct crash_record_file {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    uint32_t finished;              // set on a clean exit
+    uint32_t ring_count;            // rings handed out so far
+    uint32_t ring_entries;
+    crash_ring rings[CRASH_RECORD_RINGS];
+};
+
+crash_record_file* crash_record = NULL;
+__thread crash_ring* thread_crash_ring = NULL;
+__thread input_snapshot local_input;    // without --crash-record
+
+
+static inline const input_snapshot* current_input(void) {
+    const crash_ring* ring = thread_crash_ring;
+    if( ring && ring->count )
+        return &ring->entries[(ring->count - 1) & (CRASH_RING_ENTRIES-1)];
+    return &local_input;
+}
+
+const char* machine_mode_name( int machine_mode );
+
+// Modes that drive something other than the decoder can
+// install a function that prints what they were doing.
+void (*crash_context_printer)(void) = NULL;
+
+// operand_count of a --operand-guard decode in flight, else -1.
+__thread int operand_guard_count = -1;
+
+
+// ---------------------------------------------------
+//   Stats board (--board). Each fuzzing thread owns a
+//   slot of the process's board, and publishes its
+//   status histogram every 64k iterations; see
+//   zydis_fuzz_board.h for the layout.
+// ---------------------------------------------------
+
+board_header* board = NULL;
+char board_name[64];
+__thread board_slot* thread_board_slot = NULL;
+__thread uint64_t status_counts[BOARD_STATUS_BUCKETS];
+__thread uint64_t thread_findings = 0;
+
+#define BOARD_PUBLISH_INTERVAL 65536
+
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+bool board_create( const char* mode ) {
+    snprintf( board_name, sizeof(board_name), BOARD_NAME_PREFIX "%d", (int)getpid() );
+    int fd = shm_open( board_name, O_RDWR|O_CREAT|O_TRUNC, 0644 );
+    if( fd < 0 || ftruncate( fd, sizeof(board_header) ) ) {
+        printf("Cannot create stats board %s: %s\n", board_name, strerror(errno) );
+        if( fd >= 0 )
+            close( fd );
+        return false;
+    }
+    void* p = mmap( NULL, sizeof(board_header), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED ) {
+        printf("Cannot map stats board %s: %s\n", board_name, strerror(errno) );
+        shm_unlink( board_name );
+        return false;
+    }
+    board = (board_header*)p;
+    board->version = BOARD_VERSION;
+    board->pid = (int32_t)getpid();
+    board->state = BOARD_RUNNING;
+    board->start_ns = monotonic_ns();
+    snprintf( board->mode, sizeof(board->mode), "%s", mode );
+    __atomic_store_n( &board->magic, BOARD_MAGIC, __ATOMIC_RELEASE );
+    return true;
+}
+
+
+// Give the calling thread a slot; without a board, or once
+// all slots are taken, the thread just does not publish.
+
+void board_claim_slot(void) {
+    if( !board )
+        return;
+    uint32_t index = __atomic_fetch_add( &board->slot_count, 1, __ATOMIC_RELAXED );
+    if( index >= BOARD_SLOTS )
+        return;
+    thread_board_slot = &board->slots[index];
+    __atomic_store_n( &thread_board_slot->in_use, 1, __ATOMIC_RELEASE );
+}
+
+
+void board_publish(void) {
+    board_slot* slot = thread_board_slot;
+    int k;
+    if( !slot )
+        return;
+    uint64_t iterations = 0;
+    board_slot_begin( slot );
+    for( k=0; k<BOARD_STATUS_BUCKETS; k++ ) {
+        slot->status_counts[k] = status_counts[k];
+        iterations += status_counts[k];
+    }
+    slot->iterations = iterations;
+    slot->findings = thread_findings;
+    slot->updated_ns = monotonic_ns();
+    board_slot_end( slot );
+}
+
+
+// A board that ends with the process is removed; one left by
+// a crashed process stays, so that the monitor can show it.
+
+void board_close(void) {
+    if( !board )
+        return;
+    board_publish();
+    __atomic_store_n( &board->state, BOARD_FINISHED, __ATOMIC_RELEASE );
+    munmap( board, sizeof(board_header) );
+    board = NULL;
+    shm_unlink( board_name );
+}
+
+
+
+// ---------------------------------------------------
+//   Stage timeline (--trace=FILE). Threads record a
+//   complete event (begin and end) per batch-level
+//   stage: chunks of the fuzz loop, blocks, board
+//   publishing, breadcrumbs and reports, digest
+//   writes and oracle batches. Each thread owns its
+//   buffer, so recording takes no lock; the buffers
+//   are written as Chrome trace JSON at the end, for
+//   chrome://tracing or Perfetto.
+// ---------------------------------------------------
+
+#define TRACE_EVENTS 65536
+#define MAX_TRACE_THREADS 256
+
+struct trace_event {
+    const char* name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    long long arg;
+};
+
+struct trace_buffer {
+    int tid;
+    const char* thread_name;
+    uint32_t count;
+    uint64_t dropped;       // events past a full buffer
+    trace_event events[TRACE_EVENTS];
+};
+
+bool tracing = false;
+uint64_t trace_start_ns;
+trace_buffer* trace_buffers[MAX_TRACE_THREADS];
+uint32_t trace_buffer_count = 0;
+__thread trace_buffer* thread_trace = NULL;
+
+// Threads beyond MAX_TRACE_THREADS share this always-full
+// buffer; their events are counted in trace_overflow_dropped,
+// since its own dropped field would be raced on.
+trace_buffer trace_overflow;
+uint64_t trace_overflow_dropped = 0;
+
+
+trace_buffer* trace_thread_buffer(void) {
+    if( thread_trace )
+        return thread_trace;
+    uint32_t index = __atomic_fetch_add( &trace_buffer_count, 1, __ATOMIC_RELAXED );
+    if( index >= MAX_TRACE_THREADS ) {
+        thread_trace = &trace_overflow;
+        return thread_trace;
+    }
+    trace_buffer* buf = (trace_buffer*)calloc( 1, sizeof(trace_buffer) );
+    buf->tid = (int)index;
+    buf->thread_name = "thread";
+    __atomic_store_n( &trace_buffers[index], buf, __ATOMIC_RELEASE );
+    thread_trace = buf;
+    return buf;
+}
+
+
+void trace_thread_name( const char* name ) {
+    if( tracing ) {
+        trace_buffer* buf = trace_thread_buffer();
+        if( buf != &trace_overflow )
+            buf->thread_name = name;
+    }
+}
+
+
+void trace_record( const char* name, uint64_t begin_ns, long long arg ) {
+    trace_buffer* buf = trace_thread_buffer();
+    if( buf == &trace_overflow ) {
+        __atomic_fetch_add( &trace_overflow_dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    if( buf->count == TRACE_EVENTS ) {
+        buf->dropped++;
+        return;
+    }
+    trace_event* e = &buf->events[buf->count++];
+    e->name = name;
+    e->begin_ns = begin_ns;
+    e->end_ns = monotonic_ns();
+    e->arg = arg;
+}
+
+
+static inline uint64_t trace_begin(void) {
+    return tracing ? monotonic_ns() : 0;
+}
+
+static inline void trace_end( const char* name, uint64_t begin_ns, long long arg ) {
+    if( tracing )
+        trace_record( name, begin_ns, arg );
+}
+
+
+void trace_start(void) {
+    tracing = true;
+    trace_start_ns = monotonic_ns();
+    trace_thread_name( "main" );
+}
+
+
+// Call once all recording threads are done.
+
+bool trace_write( const char* path ) {
+    FILE* f = fopen( path, "w" );
+    if( !f ) {
+        printf("Cannot write trace %s: %s\n", path, strerror(errno) );
+        return false;
+    }
+    uint32_t i, threads = __atomic_load_n( &trace_buffer_count, __ATOMIC_ACQUIRE );
+    uint64_t events = 0, dropped = __atomic_load_n( &trace_overflow_dropped, __ATOMIC_RELAXED );
+    int pid = (int)getpid();
+    if( threads > MAX_TRACE_THREADS )
+        threads = MAX_TRACE_THREADS;
+    fprintf( f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+    fprintf( f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"zydis_fuzzer\"}}", pid );
+    for( i=0; i<threads; i++ ) {
+        const trace_buffer* buf = __atomic_load_n( &trace_buffers[i], __ATOMIC_ACQUIRE );
+        uint32_t k;
+        if( !buf )
+            continue;
+        fprintf( f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+            pid, buf->tid, buf->thread_name, buf->tid );
+        for( k=0; k<buf->count; k++ ) {
+            const trace_event* e = &buf->events[k];
+            fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%lld}}",
+                e->name, pid, buf->tid, (e->begin_ns - trace_start_ns) / 1e3, (e->end_ns - e->begin_ns) / 1e3, e->arg );
+        }
+        events += buf->count;
+        dropped += buf->dropped;
+    }
+    fprintf( f, "\n]}\n" );
+    bool ok = !ferror( f );
+    ok = !fclose( f ) && ok;
+    if( !ok )
+        printf("Cannot write trace %s\n", path );
+    else
+        printf("Wrote %llu trace events of %u threads to %s (%llu dropped)\n",
+            (unsigned long long)events, threads, path, (unsigned long long)dropped );
+    return ok;
+}
+
+
+
+// ---------------------------------------------------
+//   Crash record file (--crash-record), see the
+//   recorded decoder inputs above.
+// ---------------------------------------------------
+
+bool crash_record_create( const char* path ) {
+    int fd = open( path, O_RDWR|O_CREAT|O_TRUNC, 0644 );
+    if( fd < 0 || ftruncate( fd, sizeof(crash_record_file) ) ) {
+        printf("Cannot create crash record %s: %s\n", path, strerror(errno) );
+        if( fd >= 0 )
+            close( fd );
+        return false;
+    }
+    void* p = mmap( NULL, sizeof(crash_record_file), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED ) {
+        printf("Cannot map crash record %s: %s\n", path, strerror(errno) );
+        return false;
+    }
+    crash_record = (crash_record_file*)p;
+    crash_record->version = CRASH_RECORD_VERSION;
+    crash_record->pid = (int32_t)getpid();
+    crash_record->ring_entries = CRASH_RING_ENTRIES;
+    crash_record->magic = CRASH_RECORD_MAGIC;
+    return true;
+}
+
+
+void crash_record_claim_ring(void) {
+    if( !crash_record )
+        return;
+    uint32_t index = __atomic_fetch_add( &crash_record->ring_count, 1, __ATOMIC_RELAXED );
+    if( index >= CRASH_RECORD_RINGS )
+        return;
+    crash_ring* ring = &crash_record->rings[index];
+    ring->block = -1;
+    __atomic_store_n( &ring->in_use, 1, __ATOMIC_RELEASE );
+    thread_crash_ring = ring;
+}
+
+
+void crash_record_close(void) {
+    if( !crash_record )
+        return;
+    __atomic_store_n( &crash_record->finished, 1, __ATOMIC_RELEASE );
+    munmap( crash_record, sizeof(crash_record_file) );
+    crash_record = NULL;
+}
+
+
+// Name of the crash record of a campaign worker.
+
+void worker_crash_record_path( char* out, size_t size, const char* base, int pid ) {
+    snprintf( out, size, "%s.%d", base, pid );
+}
+
+
+// Print the inputs last recorded by every thread of the process
+// that wrote the crash record, oldest first.
+
+int print_postmortem( const char* path ) {
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) {
+        printf("Cannot open crash record %s: %s\n", path, strerror(errno) );
+        return EXIT_FAILURE;
+    }
+    void* p = mmap( NULL, sizeof(crash_record_file), PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED ) {
+        printf("Cannot map crash record %s: %s\n", path, strerror(errno) );
+        return EXIT_FAILURE;
+    }
+    const crash_record_file* cr = (const crash_record_file*)p;
+    if( cr->magic != CRASH_RECORD_MAGIC || cr->version != CRASH_RECORD_VERSION
+     || cr->ring_entries != CRASH_RING_ENTRIES ) {
+        printf("%s is not a crash record of this fuzzer version\n", path );
+        munmap( p, sizeof(crash_record_file) );
+        return EXIT_FAILURE;
+    }
+    printf("Crash record of pid %d: %s\n", cr->pid,
+        cr->finished ? "the process exited cleanly" : "the process did not exit cleanly" );
+    uint32_t ring_count = cr->ring_count < CRASH_RECORD_RINGS ? cr->ring_count : CRASH_RECORD_RINGS;
+    uint32_t r;
+    for( r=0; r<ring_count; r++ ) {
+        const crash_ring* ring = &cr->rings[r];
+        if( !ring->in_use )
+            continue;
+        uint64_t count = ring->count;
+        uint64_t first = count > CRASH_RING_ENTRIES ? count - CRASH_RING_ENTRIES : 0;
+        printf("Thread %u: %llu inputs recorded", r, (unsigned long long)count );
+        if( ring->block >= 0 )
+            printf(", in block %lld (replay with --block=%lld)",
+                (long long)ring->block, (long long)ring->block );
+        printf("\n");
+        uint64_t n;
+        for( n=first; n<count; n++ ) {
+            const input_snapshot* in = &ring->entries[n & (CRASH_RING_ENTRIES-1)];
+            int k;
+            printf("  %c #%-12llu %-12s", n+1 == count ? '>' : ' ',
+                (unsigned long long)n, machine_mode_name( in->machine_mode ) );
+            for( k=0; k<16; k++ )
+                printf(" %02X", in->bytes[k] );
+            printf("\n");
+        }
+    }
+    munmap( p, sizeof(crash_record_file) );
+    return 0;
+}
 
-// recorded data for last instruction
-uint8_t instr_buf[16];
-int machine_mode_int;
-const char* machine_mode_str;
 
 
 // ---------------------------------------------------
@@ -40,16 +483,53 @@ void sigabrt_handler( int signal_type ) {
         case SIGBUS:  sigstr = "SIGBUS";  break;
         default:      sigstr = "n/a";     break;
     }
-    printf("Machine mode: %d (%s)\n", machine_mode_int, machine_mode_str);
+    const input_snapshot* input = current_input();
+    printf("Machine mode: %d (%s)\n", input->machine_mode, machine_mode_name( input->machine_mode ) );
     printf("Opcode at time of %s:\n", sigstr );
     for(i=0;i<16;i++)
-        printf("%02X ", instr_buf[i] );
+        printf("%02X ", input->bytes[i] );
     printf("\n");
+    if( operand_guard_count >= 0 )
+        printf("Decoding into a guarded operand array with operand_count %d\n", operand_guard_count );
+    if( crash_context_printer )
+        crash_context_printer();
     fflush(stdout);
+    if( board ) {
+        thread_findings++;
+        board_publish();
+        board->state = BOARD_CRASHED;
+    }
     exit( EXIT_FAILURE );
 }
 
 
+// Report a violated invariant of the library under test. The
+// abort() lands in the handler above, which prints the input.
+
+// Block-mode workers (--threads) catch violations instead,
+// so that the earliest one in block order can be reported.
+
+__thread jmp_buf* finding_jump = NULL;
+__thread char finding_message[256];
+
+void invariant_failed( const char* fmt, ... ) {
+    va_list ap;
+    if( finding_jump ) {
+        va_start( ap, fmt );
+        vsnprintf( finding_message, sizeof(finding_message), fmt, ap );
+        va_end( ap );
+        longjmp( *finding_jump, 1 );
+    }
+    printf("\nInvariant violated: ");
+    va_start( ap, fmt );
+    vprintf( fmt, ap );
+    va_end( ap );
+    printf("\n");
+    fflush(stdout);
+    abort();
+}
+
+
 int install_sigabrt_handler(void) {
     struct sigaction sa;
     sigemptyset( &(sa.sa_mask) );
@@ -69,6 +549,76 @@ int install_sigabrt_handler(void) {
 //   multi-byte escape sequences.
 // ---------------------------------------------------
 
+// Random source of the input generator. Worker threads point
+// this at their own rand_r() state; the main thread keeps
+// using rand(), so that a seed still reproduces the same
+// input stream as before.
+
+__thread unsigned int* thread_rand_state = NULL;
+
+static inline int fuzz_rand(void) {
+    return thread_rand_state ? rand_r( thread_rand_state ) : rand();
+}
+
+
+// Every decision of the generator is drawn through the
+// entropy_*() functions below. By default they take one
+// fuzz_rand() value per decision, exactly as before. With
+// thread_entropy set, they consume an external byte stream
+// instead, the way libFuzzer's FuzzedDataProvider does:
+// decisions from the end of the data, raw tail bytes from
+// the front, and zeros once it is used up. A coverage-guided
+// fuzzer mutating that stream then mutates generator
+// decisions (prefix count, escape, VEX/EVEX fields) rather
+// than the instruction bytes.
+
+struct entropy_stream {
+    const uint8_t* data;
+    size_t front;       // next tail byte
+    size_t back;        // one past the next decision byte
+};
+
+__thread entropy_stream* thread_entropy = NULL;
+
+void entropy_stream_init( entropy_stream* s, const uint8_t* data, size_t size ) {
+    s->data = data;
+    s->front = 0;
+    s->back = size;
+}
+
+// A value in [0, n), from as many bytes as n needs.
+uint32_t entropy_stream_range( entropy_stream* s, uint32_t n ) {
+    uint32_t value = 0;
+    uint32_t span = n - 1;
+    int shift;
+    for( shift=0; shift<32 && (span >> shift) && s->back > s->front; shift+=8 )
+        value |= (uint32_t)s->data[--s->back] << shift;
+    return n ? value % n : 0;
+}
+
+uint8_t entropy_stream_byte( entropy_stream* s ) {
+    return s->front < s->back ? s->data[s->front++] : 0;
+}
+
+static inline uint32_t entropy_range( uint32_t n ) {
+    if( __builtin_expect( thread_entropy != NULL, 0 ) )
+        return entropy_stream_range( thread_entropy, n );
+    return (uint32_t)fuzz_rand() % n;
+}
+
+static inline uint32_t entropy_bits( int bits ) {
+    if( __builtin_expect( thread_entropy != NULL, 0 ) )
+        return entropy_stream_range( thread_entropy, 1u << bits );
+    return (uint32_t)fuzz_rand() & ((1u << bits) - 1);
+}
+
+static inline uint8_t entropy_byte(void) {
+    if( __builtin_expect( thread_entropy != NULL, 0 ) )
+        return entropy_stream_byte( thread_entropy );
+    return fuzz_rand() & 0xFF;
+}
+
+
 // Helper function to scribble a sequence of
 // randomized x86 instruction prefix bytes.
 
@@ -96,11 +646,11 @@ void generate_prefix_bytes(
     int i;
     if( is_64bit ) {
         for( i=0; i<bytecount; i++ ) {
-            dst[i] = prefix_collection[ rand() % sizeof(prefix_collection) ];
+            dst[i] = prefix_collection[ entropy_range( sizeof(prefix_collection) ) ];
         }
     } else {
         for( i=0; i<bytecount; i++ ) {
-            dst[i] = prefix_collection[ rand() % (sizeof(prefix_collection)-16u) ];
+            dst[i] = prefix_collection[ entropy_range( sizeof(prefix_collection)-16u ) ];
         }
     }
 }
@@ -124,7 +674,7 @@ void generate_rand_instr(
     uint8_t buf[64],
     bool is_64bit ) {
     // 0 to 15 prefixes, biased towards smaller numbers
-    int r2 = rand() % 254;  // 0 to 253
+    int r2 = entropy_range( 254 );  // 0 to 253
     int num_prefixes = (r2*r2*r2) >> 20;
 
     // output the required number of instruction prefixes
@@ -133,7 +683,7 @@ void generate_rand_instr(
     // output a randomized escape sequence
     uint8_t* bufptr = buf + num_prefixes;
 
-    switch( rand() % 32 ) {
+    switch( entropy_range( 32 ) ) {
         case 0: break;  // regular intructions without escapes
         case 1: *bufptr++ = 0x0F; *bufptr++ = 0x0F; break; // 3dnow
         case 2: *bufptr++ = 0x0F; *bufptr++ = 0x38; break; // 0F 38 escape
@@ -145,10 +695,10 @@ void generate_rand_instr(
         case 8:
         case 9:
         case 10: {  // EVEX sequence
-            uint32_t rv = rand();
+            uint32_t rv = entropy_bits( 10 );
             *bufptr++ = 0x62;
             *bufptr++ = rv & ((rv & 0x300) ? 0xF7 : 0xFF);
-            rv = rand();
+            rv = entropy_bits( 10 );
             *bufptr++ = rv | ((rv & 0x300) ? 0 : 0x78);
             break;
         }
@@ -158,10 +708,10 @@ void generate_rand_instr(
         case 14:
         case 15:
         case 16: {  // VEX3 sequence
-            uint32_t rv = rand();
+            uint32_t rv = entropy_bits( 10 );
             *bufptr++ = 0xC4;
             *bufptr++ = rv & ((rv & 0x300) ? 0xE3 : 0xFF);
-            rv = rand();
+            rv = entropy_bits( 10 );
             *bufptr++ = rv | ((rv & 0x300) ? 0 : 0x78 );
             break;
         }
@@ -171,16 +721,16 @@ void generate_rand_instr(
         case 20:
         case 21:
         case 22: {  // VEX2 sequence
-            uint32_t rv = rand();
+            uint32_t rv = entropy_bits( 10 );
             *bufptr++ = 0xC5;
             *bufptr++ = rv | ((rv & 0x300) ? 0 : 0x78 );
             break;
         }
         default: { // 23 to 31: XOP sequence
-            uint32_t rv = rand();
+            uint32_t rv = entropy_bits( 10 );
             *bufptr++ = 0x8F;
             *bufptr++ = (rv & ((rv & 0x300) ? 0xE3 : 0xFF)) ^ 8;
-            rv = rand();
+            rv = entropy_bits( 10 );
             *bufptr++ = rv | ((rv & 0x300) ? 0 : 0x78 );
             break;
         }
@@ -191,8 +741,119 @@ void generate_rand_instr(
     int remain_offset = bufptr - buf;
     int i;
     for( i=remain_offset; i<64; i++) {
-        buf[i] = rand() & 0xFF;
+        buf[i] = entropy_byte();
+    }
+}
+
+
+
+// ---------------------------------------------------
+//   Per-iteration cost attribution profiler.
+//   Every Nth iteration of the main loop is timed
+//   phase by phase with the cycle counter, and the
+//   samples are aggregated into a breakdown that
+//   is printed with the breadcrumbs.
+// ---------------------------------------------------
+
+// Read the CPU timestamp counter where available; elsewhere
+// fall back to a monotonic nanosecond clock.
+
+static inline uint64_t read_cycle_counter(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+
+// Wall-clock seconds, for throughput reporting.
+
+double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+enum profile_phase {
+    PROFILE_GENERATE,   // decoder selection and generate_rand_instr()
+    PROFILE_RECORD,     // memcpy and machine-mode bookkeeping
+    PROFILE_DECODE,     // ZydisDecoderDecodeFull() itself
+    PROFILE_LOOP,       // breadcrumbs and loop overhead
+    PROFILE_PHASE_COUNT
+};
+
+static const char* const profile_phase_names[PROFILE_PHASE_COUNT] = {
+    "generate (rng)",
+    "record (memcpy+mode)",
+    "decode",
+    "loop overhead"
+};
+
+struct profile_state {
+    int interval;                           // 0 = profiler disabled
+    int countdown;                          // iterations until next sample
+    uint64_t timer_overhead;                // cost of one timer read
+    uint64_t samples;
+    uint64_t phase_total[PROFILE_PHASE_COUNT];
+    uint64_t last_end;                      // decode end of pending sample
+    bool pending;                           // loop phase still open
+};
+
+profile_state profile;
+
+
+// Estimate the cost of reading the timer, so that it can
+// be subtracted from every measured phase.
+
+void profile_init( int interval ) {
+    int i;
+    memset( &profile, 0, sizeof(profile) );
+    profile.interval  = interval;
+    profile.countdown = interval;
+    uint64_t best = ~(uint64_t)0;
+    for( i=0; i<1000; i++ ) {
+        uint64_t t0 = read_cycle_counter();
+        uint64_t t1 = read_cycle_counter();
+        if( t1 - t0 < best )
+            best = t1 - t0;
+    }
+    profile.timer_overhead = best;
+}
+
+
+static inline void profile_add( int phase, uint64_t t_begin, uint64_t t_end ) {
+    uint64_t delta = t_end - t_begin;
+    delta = delta > profile.timer_overhead ? delta - profile.timer_overhead : 0;
+    profile.phase_total[phase] += delta;
+}
+
+
+void profile_report(void) {
+    int i;
+    if( !profile.samples )
+        return;
+    uint64_t total = 0;
+    for( i=0; i<PROFILE_PHASE_COUNT; i++ )
+        total += profile.phase_total[i];
+#if defined(__x86_64__) || defined(__i386__)
+    const char* unit = "cycles";
+#else
+    const char* unit = "ns";
+#endif
+    printf("Cost attribution over %llu sampled iterations (1 in %d), %s/iteration:\n",
+        (unsigned long long)profile.samples, profile.interval, unit );
+    for( i=0; i<PROFILE_PHASE_COUNT; i++ ) {
+        printf("  %-22s %9.1f  %5.1f%%\n",
+            profile_phase_names[i],
+            (double)profile.phase_total[i] / profile.samples,
+            total ? 100.0 * profile.phase_total[i] / total : 0.0 );
     }
+    printf("  %-22s %9.1f\n", "total", (double)total / profile.samples );
+    fflush(stdout);
 }
 
 
@@ -203,6 +864,35 @@ void generate_rand_instr(
 
 #include <Zydis/Zydis.h>
 
+// Record an instruction byte sequence and the machine
+// mode of the decoder it is about to be submitted to,
+// for the benefit of the signal handler.
+
+const char* machine_mode_name( int machine_mode ) {
+    switch( machine_mode ) {
+        case ZYDIS_MACHINE_MODE_LONG_64:   return "long64";
+        case ZYDIS_MACHINE_MODE_LEGACY_32: return "protected32";
+        case ZYDIS_MACHINE_MODE_LEGACY_16: return "protected16";
+        case ZYDIS_MACHINE_MODE_REAL_16:   return "real16";
+        default:                           return "(n/a)";
+    }
+}
+
+
+static inline void record_decoder_input(
+    const ZydisDecoder* decoder,
+    const void* buffer ) {
+    crash_ring* ring = thread_crash_ring;
+    input_snapshot* snapshot = ring
+        ? &ring->entries[ring->count & (CRASH_RING_ENTRIES-1)]
+        : &local_input;
+    memcpy( snapshot->bytes, buffer, 16 );
+    snapshot->machine_mode = decoder->machine_mode;
+    if( ring )
+        __atomic_store_n( &ring->count, ring->count + 1, __ATOMIC_RELEASE );
+}
+
+
 // wrapped version of the Zydis decoder function
 // that records an instruction byte sequence
 // before calling the decoder itself.
@@ -217,15 +907,7 @@ ZyanStatus wrapped_ZydisDecoderDecodeFull(
     ZyanU8 operand_count,
     ZydisDecodingFlags flags) {
         
-    memcpy( instr_buf, buffer, 16 );
-    machine_mode_int = decoder->machine_mode;
-    switch( machine_mode_int ) {
-        case ZYDIS_MACHINE_MODE_LONG_64:   machine_mode_str = "long64";      break;
-        case ZYDIS_MACHINE_MODE_LEGACY_32: machine_mode_str = "protected32"; break;
-        case ZYDIS_MACHINE_MODE_LEGACY_16: machine_mode_str = "protected16"; break;
-        case ZYDIS_MACHINE_MODE_REAL_16:   machine_mode_str = "real16";      break;
-        default:                           machine_mode_str = "(n/a)";       break;
-    }
+    record_decoder_input( decoder, buffer );
     return ZydisDecoderDecodeFull(
         decoder,
         buffer,
@@ -239,77 +921,5907 @@ ZyanStatus wrapped_ZydisDecoderDecodeFull(
 
 
 
+// Same as wrapped_ZydisDecoderDecodeFull(), but with
+// the bookkeeping and the decode itself timed as
+// separate profiler phases.
+
+ZyanStatus profiled_ZydisDecoderDecodeFull(
+    const ZydisDecoder* decoder,
+    const void* buffer,
+    ZyanUSize length,
+    ZydisDecodedInstruction* instruction,
+    ZydisDecodedOperand* operands,
+    ZyanU8 operand_count,
+    ZydisDecodingFlags flags,
+    uint64_t t_start ) {
+
+    uint64_t t_generated = read_cycle_counter();
+    record_decoder_input( decoder, buffer );
+    uint64_t t_recorded = read_cycle_counter();
+    ZyanStatus status = ZydisDecoderDecodeFull(
+        decoder,
+        buffer,
+        length,
+        instruction,
+        operands,
+        operand_count,
+        flags
+        );
+    uint64_t t_decoded = read_cycle_counter();
+
+    profile_add( PROFILE_GENERATE, t_start, t_generated );
+    profile_add( PROFILE_RECORD, t_generated, t_recorded );
+    profile_add( PROFILE_DECODE, t_recorded, t_decoded );
+    profile.samples++;
+    profile.last_end = t_decoded;
+    profile.pending = true;
+    return status;
+}
+
+
+
 
 
 // --------------------------
 //   Fuzzer main function
 // --------------------------
 
-int main( int argc, char *argv[] ) {
+// ---------------------------------------------------
+//   The set of decoders that inputs are fuzzed
+//   against. Inputs are tagged with the index of the
+//   decoder they were generated for, so that they can
+//   be replayed by another process.
+// ---------------------------------------------------
 
+enum decoder_slot {
+    DECODER_X86_16,
+    DECODER_X86_32,
+    DECODER_X86_64_INTEL,   // x86-64 with Intel branch behavior
+    DECODER_X86_64_AMD,     // x86-64 with AMD branch behavior
+    DECODER_X86_64,         // x86-64 without KNC, for re-decoding encoder output
+    DECODER_COUNT
+};
+
+// The fuzz loop draws among the first four decoders.
+#define FUZZ_DECODER_COUNT 4
+
+static const int decoder_bits[DECODER_COUNT] = { 16, 32, 64, 64, 64 };
+
+ZydisDecoder decoders[DECODER_COUNT];
+
+
+static const struct {
+    ZydisMachineMode machine_mode;
+    ZydisStackWidth stack_width;
+    bool knc;
+    bool amd_branches;
+} decoder_configs[DECODER_COUNT] = {
+    { ZYDIS_MACHINE_MODE_LEGACY_16, ZYDIS_STACK_WIDTH_16, false, false },
+    { ZYDIS_MACHINE_MODE_LEGACY_32, ZYDIS_STACK_WIDTH_32, false, false },
+    { ZYDIS_MACHINE_MODE_LONG_64,   ZYDIS_STACK_WIDTH_64, true,  false },
+    { ZYDIS_MACHINE_MODE_LONG_64,   ZYDIS_STACK_WIDTH_64, true,  true  },
+    { ZYDIS_MACHINE_MODE_LONG_64,   ZYDIS_STACK_WIDTH_64, false, false }
+};
+
+
+void init_decoders(void) {
     int i;
-    srand( argc > 1 ? atoi( argv[1] ) : 0);
-    install_sigabrt_handler();
+    for( i=0; i<DECODER_COUNT; i++ ) {
+        ZydisDecoderInit( &decoders[i], decoder_configs[i].machine_mode, decoder_configs[i].stack_width );
+        if( decoder_configs[i].knc )
+            ZydisDecoderEnableMode( &decoders[i], ZYDIS_DECODER_MODE_KNC, true );
+        if( decoder_configs[i].amd_branches )
+            ZydisDecoderEnableMode( &decoders[i], ZYDIS_DECODER_MODE_AMD_BRANCHES, true );
+    }
+}
 
 
-    // --------------------------------------
-    //   Prepare Zydis instruction decoders
-    // --------------------------------------
 
-    ZydisDecoder decoder_x86_16;
-    ZydisDecoder decoder_x86_32;
-    ZydisDecoder decoder_x86_64_intel; // x86-64 with Intel branch behavior
-    ZydisDecoder decoder_x86_64_amd;   // x86-64 with AMD branch behavior
+// Formatters used by the formatting stages and shared
+// between threads by the concurrency stress mode.
 
-    ZydisDecoderInit( &decoder_x86_16,       ZYDIS_MACHINE_MODE_LEGACY_16, ZYDIS_STACK_WIDTH_16 );
-    ZydisDecoderInit( &decoder_x86_32,       ZYDIS_MACHINE_MODE_LEGACY_32, ZYDIS_STACK_WIDTH_32 );
-    ZydisDecoderInit( &decoder_x86_64_intel, ZYDIS_MACHINE_MODE_LONG_64,   ZYDIS_STACK_WIDTH_64 );
-    ZydisDecoderInit( &decoder_x86_64_amd,   ZYDIS_MACHINE_MODE_LONG_64,   ZYDIS_STACK_WIDTH_64 );
+ZydisFormatter formatter_intel;
+ZydisFormatter formatter_att;
+ZydisFormatter formatter_masm;
 
-    ZydisDecoderEnableMode( &decoder_x86_64_intel, ZYDIS_DECODER_MODE_KNC, true );
-    ZydisDecoderEnableMode( &decoder_x86_64_amd,   ZYDIS_DECODER_MODE_KNC, true );
-    ZydisDecoderEnableMode( &decoder_x86_64_amd,   ZYDIS_DECODER_MODE_AMD_BRANCHES, true );
+void init_formatters(void) {
+    ZydisFormatterInit( &formatter_intel, ZYDIS_FORMATTER_STYLE_INTEL );
+    ZydisFormatterInit( &formatter_att,   ZYDIS_FORMATTER_STYLE_ATT );
+    ZydisFormatterInit( &formatter_masm,  ZYDIS_FORMATTER_STYLE_INTEL_MASM );
+}
 
 
-    // ---------------------------------------
-    //   Main loop runs 2 billion iterations
-    // ---------------------------------------
 
-    for(i=0;i<2000000000;i++) {
-        uint8_t buf[64];
-        int bits;
-        ZydisDecoder *decoder_to_use;
-        switch( rand() & 3 ) {
-            case 0: bits = 16; decoder_to_use = &decoder_x86_16;       break;
-            case 1: bits = 32; decoder_to_use = &decoder_x86_32;       break;
-            case 2: bits = 64; decoder_to_use = &decoder_x86_64_intel; break;
-            case 3: bits = 64; decoder_to_use = &decoder_x86_64_amd;   break;
+// ---------------------------------------------------
+//   Encoding patterns (--patterns=FILE). Each line of
+//   the file describes one family of encodings, e.g.
+//
+//     weight=4 mode=64  66? F2|F3? 0F 38 [op] [modrm mod!=3] disp8
+//     EVEX(mm=2, W=1) [op] [modrm mod=3] imm8?
+//
+//   and is compiled at startup into a flat run of byte
+//   ops. Each op emits one byte: a fixed part, bits
+//   drawn from the entropy source, or one of a list of
+//   alternatives; an op may start an optional group
+//   and may redraw once its masked bits equal a
+//   forbidden value. Patterns are picked through a
+//   slot table in proportion to their weights. The
+//   rest of the 64-byte input is filled randomly.
+//
+//   Elements:
+//     XX              a hex byte
+//     XX|YY|...       one of these bytes
+//     ??, [op]        a random byte
+//     [legacy]        a random legacy prefix
+//     [rex F=v ...]   REX with fields W R X B
+//     [modrm F=v ...] ModRM with fields mod reg rm
+//     [sib F=v ...]   SIB with fields scale index base
+//     disp8 disp16 disp32 imm8 imm16 imm32 imm64
+//     VEX2(...) VEX3(...) XOP(...) EVEX(...)
+//   VEX2: R vvvv L pp. VEX3, XOP: R X B mm W vvvv L pp.
+//   EVEX: R X B R' mm W vvvv U pp z LL b V' aaa. Values
+//   are the raw encoded bits, so R, X, B, R', V' and
+//   vvvv are inverted. Fields left out are random, and
+//   one F!=v per byte is allowed. A trailing ? makes
+//   the element optional (50%). # starts a comment.
+// ---------------------------------------------------
+
+#define MAX_PATTERNS 256
+#define MAX_PATTERN_OPS 4096
+#define MAX_PATTERN_ALTERNATIVES 4096
+#define PATTERN_MAX_BYTES 32
+#define PATTERN_PICK_SLOTS 4096
+#define PATTERN_REDRAWS 8
+
+struct pattern_op {
+    uint8_t random;         // bits drawn from the entropy source
+    uint8_t fixed;          // bits given by the pattern
+    uint8_t not_mask;       // redraw while (byte & not_mask) == not_value
+    uint8_t not_value;
+    uint8_t optional;       // first op of an optional element
+    uint8_t group;          // ops in the element, to skip it
+    uint8_t alt_count;      // > 0: pick one of the alternatives
+    uint8_t pad;
+    uint16_t alt_first;
+};
+
+struct pattern {
+    int first_op;
+    int op_count;
+    int weight;
+    int decoder_count;      // 0: any fuzz decoder
+    int decoder_indices[2];
+};
+
+struct pattern_set {
+    int count;
+    int op_count;
+    int alt_count;
+    pattern list[MAX_PATTERNS];
+    pattern_op ops[MAX_PATTERN_OPS];
+    uint8_t alternatives[MAX_PATTERN_ALTERNATIVES];
+    uint16_t pick[PATTERN_PICK_SLOTS];
+};
+
+pattern_set* patterns = NULL;
+
+
+struct pattern_field {
+    const char* kind;
+    const char* name;
+    int byte;               // within the element
+    int shift;
+    int width;
+};
+
+static const pattern_field pattern_fields[] = {
+    { "VEX2",  "R",     1, 7, 1 }, { "VEX2",  "vvvv",  1, 3, 4 }, { "VEX2",  "L",     1, 2, 1 },
+    { "VEX2",  "pp",    1, 0, 2 },
+    { "VEX3",  "R",     1, 7, 1 }, { "VEX3",  "X",     1, 6, 1 }, { "VEX3",  "B",     1, 5, 1 },
+    { "VEX3",  "mm",    1, 0, 5 }, { "VEX3",  "W",     2, 7, 1 }, { "VEX3",  "vvvv",  2, 3, 4 },
+    { "VEX3",  "L",     2, 2, 1 }, { "VEX3",  "pp",    2, 0, 2 },
+    { "XOP",   "R",     1, 7, 1 }, { "XOP",   "X",     1, 6, 1 }, { "XOP",   "B",     1, 5, 1 },
+    { "XOP",   "mm",    1, 0, 5 }, { "XOP",   "W",     2, 7, 1 }, { "XOP",   "vvvv",  2, 3, 4 },
+    { "XOP",   "L",     2, 2, 1 }, { "XOP",   "pp",    2, 0, 2 },
+    { "EVEX",  "R",     1, 7, 1 }, { "EVEX",  "X",     1, 6, 1 }, { "EVEX",  "B",     1, 5, 1 },
+    { "EVEX",  "R'",    1, 4, 1 }, { "EVEX",  "mm",    1, 0, 3 }, { "EVEX",  "W",     2, 7, 1 },
+    { "EVEX",  "vvvv",  2, 3, 4 }, { "EVEX",  "U",     2, 2, 1 }, { "EVEX",  "pp",    2, 0, 2 },
+    { "EVEX",  "z",     3, 7, 1 }, { "EVEX",  "LL",    3, 5, 2 }, { "EVEX",  "b",     3, 4, 1 },
+    { "EVEX",  "V'",    3, 3, 1 }, { "EVEX",  "aaa",   3, 0, 3 },
+    { "modrm", "mod",   0, 6, 2 }, { "modrm", "reg",   0, 3, 3 }, { "modrm", "rm",    0, 0, 3 },
+    { "sib",   "scale", 0, 6, 2 }, { "sib",   "index", 0, 3, 3 }, { "sib",   "base",  0, 0, 3 },
+    { "rex",   "W",     0, 3, 1 }, { "rex",   "R",     0, 2, 1 }, { "rex",   "X",     0, 1, 1 },
+    { "rex",   "B",     0, 0, 1 }
+};
+
+// Element kinds with fields: length and escape byte.
+static const struct {
+    const char* kind;
+    int length;
+    int escape;             // -1: none
+    uint8_t fixed_high;     // REX: 0100xxxx
+} pattern_kinds[] = {
+    { "VEX2", 2, 0xC5, 0 }, { "VEX3", 3, 0xC4, 0 }, { "XOP", 3, 0x8F, 0 }, { "EVEX", 4, 0x62, 0 },
+    { "modrm", 1, -1, 0 },  { "sib", 1, -1, 0 },    { "rex", 1, -1, 0x40 }
+};
+
+static const struct {
+    const char* name;
+    int length;
+} pattern_fillers[] = {
+    { "??", 1 },     { "op", 1 },     { "byte", 1 },
+    { "disp8", 1 },  { "disp16", 2 }, { "disp32", 4 },
+    { "imm8", 1 },   { "imm16", 2 },  { "imm32", 4 },  { "imm64", 8 }
+};
+
+
+int parse_hex_byte( const char* p, size_t n ) {
+    int i, value = 0;
+    if( n != 2 )
+        return -1;
+    for( i=0; i<2; i++ ) {
+        char c = p[i];
+        int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if( d < 0 )
+            return -1;
+        value = value * 16 + d;
+    }
+    return value;
+}
+
+
+// Apply "name=value" or "name!=value" assignments, separated
+// by spaces or commas, to the ops of an element of this kind.
+
+bool parse_pattern_fields( const char* kind, const char* p, const char* end, pattern_op* ops, char* error, size_t error_size ) {
+    while( p < end ) {
+        while( p < end && (*p == ' ' || *p == '\t' || *p == ',') )
+            p++;
+        if( p == end )
+            break;
+        const char* name = p;
+        while( p < end && *p != '=' && *p != '!' && *p != ' ' && *p != ',' )
+            p++;
+        size_t name_length = p - name;
+        bool negated = p < end && *p == '!';
+        if( negated )
+            p++;
+        if( p == end || *p != '=' ) {
+            snprintf( error, error_size, "expected %.*s=value", (int)name_length, name );
+            return false;
         }
-        
-        generate_rand_instr( buf, bits==64 );
-        
-        ZydisDecodedInstruction instr1;
-        ZydisDecodedOperand operands1[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
-        wrapped_ZydisDecoderDecodeFull(
-            decoder_to_use,
-            buf,
-            64,
-            &instr1,
-            operands1,
+        p++;
+        char* value_end;
+        long value = strtol( p, &value_end, 0 );
+        if( value_end == p || value_end > end ) {
+            snprintf( error, error_size, "bad value for %.*s", (int)name_length, name );
+            return false;
+        }
+        p = value_end;
+        size_t f;
+        const pattern_field* field = NULL;
+        for( f=0; f<sizeof(pattern_fields)/sizeof(pattern_fields[0]); f++ )
+            if( !strcmp( pattern_fields[f].kind, kind ) && strlen( pattern_fields[f].name ) == name_length
+                    && !strncmp( pattern_fields[f].name, name, name_length ) )
+                field = &pattern_fields[f];
+        if( !field ) {
+            snprintf( error, error_size, "%s has no field %.*s", kind, (int)name_length, name );
+            return false;
+        }
+        if( value < 0 || value >= (1L << field->width) ) {
+            snprintf( error, error_size, "%s field %s is %d bits wide", kind, field->name, field->width );
+            return false;
+        }
+        pattern_op* op = &ops[field->byte];
+        uint8_t mask = (uint8_t)(((1u << field->width) - 1) << field->shift);
+        if( negated ) {
+            if( op->not_mask ) {
+                snprintf( error, error_size, "only one != per byte" );
+                return false;
+            }
+            op->not_mask = mask;
+            op->not_value = (uint8_t)(value << field->shift);
+        } else {
+            op->random &= ~mask;
+            op->fixed = (op->fixed & ~mask) | (uint8_t)(value << field->shift);
+        }
+    }
+    return true;
+}
+
+
+// Compile one element into ops; returns the op count, or -1.
+
+int compile_pattern_element( const char* tok, size_t n, pattern_op* ops, int max_ops, char* error, size_t error_size ) {
+    size_t k;
+    memset( ops, 0, max_ops * sizeof(pattern_op) );
+
+    // alternatives or a hex byte
+    if( memchr( tok, '|', n ) || parse_hex_byte( tok, n ) >= 0 ) {
+        const char* p = tok;
+        const char* end = tok + n;
+        int count = 0;
+        while( p < end ) {
+            const char* q = (const char*)memchr( p, '|', end - p );
+            if( !q )
+                q = end;
+            int b = parse_hex_byte( p, q - p );
+            if( b < 0 ) {
+                snprintf( error, error_size, "bad byte '%.*s'", (int)(q - p), p );
+                return -1;
+            }
+            // room in the shared table, and alt_count is a uint8_t
+            if( patterns->alt_count + count >= MAX_PATTERN_ALTERNATIVES || count == 255 ) {
+                snprintf( error, error_size, "too many alternatives" );
+                return -1;
+            }
+            patterns->alternatives[patterns->alt_count + count++] = (uint8_t)b;
+            p = q + 1;
+        }
+        if( count == 1 ) {
+            ops[0].fixed = patterns->alternatives[patterns->alt_count];
+        } else {
+            ops[0].alt_first = (uint16_t)patterns->alt_count;
+            ops[0].alt_count = (uint8_t)count;
+            patterns->alt_count += count;
+        }
+        return 1;
+    }
+
+    // strip [ ] and split NAME(fields) or [NAME fields]
+    const char* body = tok;
+    const char* end = tok + n;
+    if( *body == '[' ) {
+        if( end[-1] != ']' ) {
+            snprintf( error, error_size, "missing ]" );
+            return -1;
+        }
+        body++;
+        end--;
+    }
+    const char* name_end = body;
+    while( name_end < end && *name_end != ' ' && *name_end != '(' )
+        name_end++;
+    size_t name_length = name_end - body;
+    const char* fields = name_end;
+    const char* fields_end = end;
+    if( fields < end && *fields == '(' ) {
+        if( end[-1] != ')' ) {
+            snprintf( error, error_size, "missing )" );
+            return -1;
+        }
+        fields++;
+        fields_end--;
+    }
+
+    for( k=0; k<sizeof(pattern_fillers)/sizeof(pattern_fillers[0]); k++ ) {
+        if( strlen( pattern_fillers[k].name ) == name_length && !strncmp( pattern_fillers[k].name, body, name_length ) ) {
+            int i;
+            for( i=0; i<pattern_fillers[k].length; i++ )
+                ops[i].random = 0xFF;
+            return pattern_fillers[k].length;
+        }
+    }
+    if( name_length == 6 && !strncmp( body, "legacy", 6 ) ) {
+        static const uint8_t legacy[] = { 0xF0, 0xF2, 0xF3, 0x2E, 0x36, 0x3E, 0x26, 0x64, 0x65, 0x66, 0x67 };
+        if( patterns->alt_count + (int)sizeof(legacy) > MAX_PATTERN_ALTERNATIVES ) {
+            snprintf( error, error_size, "too many alternatives" );
+            return -1;
+        }
+        memcpy( patterns->alternatives + patterns->alt_count, legacy, sizeof(legacy) );
+        ops[0].alt_first = (uint16_t)patterns->alt_count;
+        ops[0].alt_count = sizeof(legacy);
+        patterns->alt_count += sizeof(legacy);
+        return 1;
+    }
+    for( k=0; k<sizeof(pattern_kinds)/sizeof(pattern_kinds[0]); k++ ) {
+        if( strlen( pattern_kinds[k].kind ) != name_length || strncmp( pattern_kinds[k].kind, body, name_length ) )
+            continue;
+        int i, length = pattern_kinds[k].length;
+        for( i=0; i<length; i++ )
+            ops[i].random = 0xFF;
+        if( pattern_kinds[k].escape >= 0 ) {
+            ops[0].random = 0;
+            ops[0].fixed = (uint8_t)pattern_kinds[k].escape;
+        }
+        if( pattern_kinds[k].fixed_high ) {
+            ops[0].random = 0x0F;
+            ops[0].fixed = pattern_kinds[k].fixed_high;
+        }
+        if( !parse_pattern_fields( pattern_kinds[k].kind, fields, fields_end, ops, error, error_size ) )
+            return -1;
+        return length;
+    }
+    snprintf( error, error_size, "unknown element '%.*s'", (int)n, tok );
+    return -1;
+}
+
+
+// Next element of a line: up to whitespace, but [..] and (..)
+// may contain spaces. Returns its length, 0 at the end.
+
+size_t next_pattern_token( const char* p ) {
+    size_t n = 0;
+    int depth = 0;
+    while( p[n] && p[n] != '\n' && p[n] != '#' && (depth || (p[n] != ' ' && p[n] != '\t')) ) {
+        if( p[n] == '[' || p[n] == '(' )
+            depth++;
+        else if( (p[n] == ']' || p[n] == ')') && depth )
+            depth--;
+        n++;
+    }
+    return n;
+}
+
+
+bool compile_pattern_line( const char* line, char* error, size_t error_size ) {
+    pattern pat;
+    memset( &pat, 0, sizeof(pat) );
+    pat.first_op = patterns->op_count;
+    pat.weight = 1;
+    const char* p = line;
+    int max_bytes = 0;
+    for(;;) {
+        while( *p == ' ' || *p == '\t' )
+            p++;
+        size_t n = next_pattern_token( p );
+        if( !n )
+            break;
+        if( !strncmp( p, "weight=", 7 ) ) {
+            pat.weight = atoi( p + 7 );
+            if( pat.weight < 1 ) {
+                snprintf( error, error_size, "weight must be at least 1" );
+                return false;
+            }
+        } else if( !strncmp( p, "mode=", 5 ) ) {
+            int bits = atoi( p + 5 );
+            if( bits == 16 ) {
+                pat.decoder_count = 1;
+                pat.decoder_indices[0] = DECODER_X86_16;
+            } else if( bits == 32 ) {
+                pat.decoder_count = 1;
+                pat.decoder_indices[0] = DECODER_X86_32;
+            } else if( bits == 64 ) {
+                pat.decoder_count = 2;
+                pat.decoder_indices[0] = DECODER_X86_64_INTEL;
+                pat.decoder_indices[1] = DECODER_X86_64_AMD;
+            } else {
+                snprintf( error, error_size, "mode must be 16, 32 or 64" );
+                return false;
+            }
+        } else {
+            bool optional = p[n-1] == '?' && n > 1 && !(n == 2 && p[0] == '?');
+            pattern_op ops[8];
+            int count = compile_pattern_element( p, optional ? n - 1 : n, ops, 8, error, error_size );
+            if( count < 0 )
+                return false;
+            if( patterns->op_count + count > MAX_PATTERN_OPS ) {
+                snprintf( error, error_size, "too many pattern ops" );
+                return false;
+            }
+            max_bytes += count;
+            if( max_bytes > PATTERN_MAX_BYTES ) {
+                snprintf( error, error_size, "patterns may be at most %d bytes long", PATTERN_MAX_BYTES );
+                return false;
+            }
+            ops[0].optional = optional;
+            ops[0].group = (uint8_t)count;
+            memcpy( patterns->ops + patterns->op_count, ops, count * sizeof(pattern_op) );
+            patterns->op_count += count;
+        }
+        p += n;
+    }
+    pat.op_count = patterns->op_count - pat.first_op;
+    if( !pat.op_count )
+        return true;    // blank or comment
+    if( patterns->count == MAX_PATTERNS ) {
+        snprintf( error, error_size, "at most %d patterns", MAX_PATTERNS );
+        return false;
+    }
+    patterns->list[patterns->count++] = pat;
+    return true;
+}
+
+
+// Slot table: pattern i owns a share of the slots
+// proportional to its weight.
+
+void build_pattern_picks(void) {
+    uint64_t total = 0, cumulative = 0;
+    int i, slot = 0;
+    for( i=0; i<patterns->count; i++ )
+        total += patterns->list[i].weight;
+    for( i=0; i<patterns->count; i++ ) {
+        cumulative += patterns->list[i].weight;
+        int end = (int)(cumulative * PATTERN_PICK_SLOTS / total);
+        for( ; slot<end; slot++ )
+            patterns->pick[slot] = (uint16_t)i;
+    }
+}
+
+
+bool load_patterns( const char* path ) {
+    FILE* f = fopen( path, "r" );
+    if( !f ) {
+        printf("Cannot open patterns %s: %s\n", path, strerror(errno) );
+        return false;
+    }
+    patterns = (pattern_set*)calloc( 1, sizeof(pattern_set) );
+    char line[1024];
+    int line_number = 0;
+    while( fgets( line, sizeof(line), f ) ) {
+        char error[160];
+        line_number++;
+        if( !compile_pattern_line( line, error, sizeof(error) ) ) {
+            printf("%s:%d: %s\n", path, line_number, error );
+            fclose( f );
+            return false;
+        }
+    }
+    fclose( f );
+    if( !patterns->count ) {
+        printf("%s: no patterns\n", path );
+        return false;
+    }
+    build_pattern_picks();
+    printf("Loaded %d patterns (%d byte ops) from %s\n", patterns->count, patterns->op_count, path );
+    return true;
+}
+
+
+// Interpreter: one byte per op, no per-element dispatch.
+
+int generate_pattern_input( uint8_t buf[64] ) {
+    const pattern* pat = &patterns->list[ patterns->pick[ entropy_range( PATTERN_PICK_SLOTS ) ] ];
+    int decoder_index = pat->decoder_count
+        ? pat->decoder_indices[ pat->decoder_count > 1 ? entropy_bits( 1 ) : 0 ]
+        : (int)entropy_bits( 2 );
+    const pattern_op* op = patterns->ops + pat->first_op;
+    const pattern_op* end = op + pat->op_count;
+    uint8_t* out = buf;
+    while( op < end ) {
+        if( op->optional && entropy_bits( 1 ) ) {
+            op += op->group;
+            continue;
+        }
+        uint8_t b;
+        if( op->alt_count ) {
+            b = patterns->alternatives[ op->alt_first + entropy_range( op->alt_count ) ];
+        } else {
+            b = op->fixed;
+            if( op->random ) {
+                int redraws = PATTERN_REDRAWS;
+                do {
+                    b = (uint8_t)((entropy_bits( 8 ) & op->random) | op->fixed);
+                } while( op->not_mask && (b & op->not_mask) == op->not_value && --redraws );
+            }
+        }
+        *out++ = b;
+        op++;
+    }
+    int i;
+    for( i=(int)(out - buf); i<64; i++ )
+        buf[i] = entropy_byte();
+    return decoder_index;
+}
+
+
+
+// ---------------------------------------------------
+//   Hybrid sanitizer campaign.
+//
+//   Fast (-O3) worker processes fuzz as usual and push
+//   "interesting" inputs - novel decode behavior, new
+//   instruction lengths, and unusually slow decodes -
+//   into a shared-memory queue. A smaller pool of
+//   sanitizer-built worker processes replays the queue
+//   continuously. Fast workers never block on the
+//   queue; when the replayers fall behind, the oldest
+//   entries are overwritten and counted as dropped.
+// ---------------------------------------------------
+
+enum input_reason {
+    REASON_NOVEL_BEHAVIOR = 1,
+    REASON_NEW_LENGTH     = 2,
+    REASON_SLOW_DECODE    = 4
+};
+
+struct input_record {
+    uint8_t bytes[16];
+    uint8_t decoder_index;
+    uint8_t reason;         // bitmask of input_reason
+    uint8_t pad[6];
+};
+
+
+// Each slot is guarded by a sequence number: 2*pos+1 while
+// the record for queue position pos is being written, and
+// 2*pos+2 once it is complete.
+
+struct replay_queue_slot {
+    uint64_t seq;
+    input_record record;
+};
+
+#define REPLAY_QUEUE_SLOTS 65536u
+#define REPLAY_QUEUE_MAGIC 0x5A594651u   // "ZYFQ"
+
+struct replay_queue {
+    uint32_t magic;
+    uint32_t closing;           // set by the supervisor once fuzzing ends
+    uint64_t head;              // next position to write
+    uint64_t tail;              // next position to replay
+    uint64_t fuzzed;            // iterations run by fast workers
+    uint64_t replayed;
+    uint64_t dropped;
+    replay_queue_slot slots[REPLAY_QUEUE_SLOTS];
+};
+
+replay_queue* campaign_queue = NULL;    // non-NULL in fast campaign workers
+int corpus_fd = -1;                     // --save-corpus file, opened O_APPEND
+
+
+replay_queue* replay_queue_map( const char* name, bool create ) {
+    int fd = shm_open( name, create ? O_RDWR|O_CREAT|O_EXCL : O_RDWR, 0600 );
+    if( fd < 0 ) {
+        printf("Cannot open replay queue %s: %s\n", name, strerror(errno) );
+        return NULL;
+    }
+    if( create && ftruncate( fd, sizeof(replay_queue) ) ) {
+        printf("Cannot size replay queue %s: %s\n", name, strerror(errno) );
+        close( fd );
+        shm_unlink( name );
+        return NULL;
+    }
+    void* p = mmap( NULL, sizeof(replay_queue), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED ) {
+        printf("Cannot map replay queue %s: %s\n", name, strerror(errno) );
+        return NULL;
+    }
+    replay_queue* q = (replay_queue*)p;
+    if( create ) {
+        q->magic = REPLAY_QUEUE_MAGIC;
+    } else if( q->magic != REPLAY_QUEUE_MAGIC ) {
+        printf("%s is not a replay queue\n", name );
+        munmap( p, sizeof(replay_queue) );
+        return NULL;
+    }
+    return q;
+}
+
+
+void replay_queue_push( replay_queue* q, const input_record* rec ) {
+    uint64_t pos = __atomic_fetch_add( &q->head, 1, __ATOMIC_RELAXED );
+    replay_queue_slot* slot = &q->slots[pos % REPLAY_QUEUE_SLOTS];
+    __atomic_store_n( &slot->seq, 2*pos+1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    slot->record = *rec;
+    __atomic_store_n( &slot->seq, 2*pos+2, __ATOMIC_RELEASE );
+}
+
+
+// Claim the next queue entry and copy it out. Returns false
+// once the queue is closed and drained.
+
+bool replay_queue_pop( replay_queue* q, input_record* rec ) {
+    for(;;) {
+        uint64_t pos  = __atomic_load_n( &q->tail, __ATOMIC_RELAXED );
+        uint64_t head = __atomic_load_n( &q->head, __ATOMIC_ACQUIRE );
+        if( pos >= head ) {
+            if( __atomic_load_n( &q->closing, __ATOMIC_ACQUIRE ) )
+                return false;
+            usleep( 1000 );
+            continue;
+        }
+        if( head - pos > REPLAY_QUEUE_SLOTS ) {
+            // fell behind the writers by a full lap; skip ahead
+            uint64_t skip_to = head - REPLAY_QUEUE_SLOTS/2;
+            if( __atomic_compare_exchange_n( &q->tail, &pos, skip_to, false,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+                __atomic_fetch_add( &q->dropped, skip_to - pos, __ATOMIC_RELAXED );
+            continue;
+        }
+        if( !__atomic_compare_exchange_n( &q->tail, &pos, pos+1, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            continue;
+
+        replay_queue_slot* slot = &q->slots[pos % REPLAY_QUEUE_SLOTS];
+        uint64_t seq;
+        while( (seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE )) < 2*pos+2 )
+            ;   // writer claimed the slot but has not finished it yet
+        *rec = slot->record;
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( seq != 2*pos+2 || __atomic_load_n( &slot->seq, __ATOMIC_RELAXED ) != seq ) {
+            __atomic_fetch_add( &q->dropped, 1, __ATOMIC_RELAXED );
+            continue;   // overwritten by a later lap while copying
+        }
+        return true;
+    }
+}
+
+
+// Novelty tracking for the fast workers and --save-corpus: a
+// bitmap over hashed decode features. An input whose feature
+// bit was not yet set is novel. "Slow" means more than 8x the
+// running mean.
+
+#define NOVELTY_BITMAP_BITS (1u << 20)
+
+struct novelty_state {
+    uint64_t bitmap[NOVELTY_BITMAP_BITS / 64];
+    uint64_t mean_cycles_x16;   // running mean of decode cycles, times 16
+};
+
+novelty_state* novelty = NULL;
+
+
+static inline uint32_t feature_hash( uint64_t feature ) {
+    feature *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(feature >> 44);   // top 20 bits
+}
+
+
+static inline bool novelty_test_and_set( uint32_t bit ) {
+    uint64_t mask = 1ull << (bit & 63);
+    uint64_t* word = &novelty->bitmap[bit >> 6];
+    if( *word & mask )
+        return false;
+    *word |= mask;
+    return true;
+}
+
+
+// The two decode features: behavior (status, mnemonic,
+// encoding, operand count) and length (mnemonic, length).
+// The latter exists only for successful decodes.
+
+static inline uint64_t behavior_feature(
+    int decoder_index,
+    ZyanStatus status,
+    const ZydisDecodedInstruction* instr ) {
+    uint64_t behavior = ((uint64_t)decoder_index << 60) ^ ((uint64_t)status << 24) ^ 1;
+    if( ZYAN_SUCCESS(status) ) {
+        behavior ^= ((uint64_t)instr->mnemonic << 8)
+                  ^ ((uint64_t)instr->encoding << 4)
+                  ^ instr->operand_count_visible;
+    }
+    return behavior;
+}
+
+
+static inline uint64_t length_feature( int decoder_index, const ZydisDecodedInstruction* instr ) {
+    return ((uint64_t)decoder_index << 60)
+         ^ ((uint64_t)instr->mnemonic << 8)
+         ^ instr->length ^ 2;
+}
+
+
+int classify_decode(
+    int decoder_index,
+    ZyanStatus status,
+    const ZydisDecodedInstruction* instr,
+    uint64_t decode_cycles ) {
+    int reason = 0;
+    if( ZYAN_SUCCESS(status)
+     && novelty_test_and_set( feature_hash( length_feature( decoder_index, instr ) ) ) )
+        reason |= REASON_NEW_LENGTH;
+    if( novelty_test_and_set( feature_hash( behavior_feature( decoder_index, status, instr ) ) ) )
+        reason |= REASON_NOVEL_BEHAVIOR;
+
+    uint64_t mean = novelty->mean_cycles_x16 >> 4;
+    if( mean && decode_cycles > 8*mean && decode_cycles > 2000 )
+        reason |= REASON_SLOW_DECODE;
+    // exponential moving average with weight 1/16
+    novelty->mean_cycles_x16 += decode_cycles - mean;
+    return reason;
+}
+
+
+void campaign_observe(
+    int decoder_index,
+    const uint8_t* buf,
+    ZyanStatus status,
+    const ZydisDecodedInstruction* instr,
+    uint64_t decode_cycles ) {
+    int reason = classify_decode( decoder_index, status, instr, decode_cycles );
+    if( reason ) {
+        input_record rec;
+        memset( &rec, 0, sizeof(rec) );
+        memcpy( rec.bytes, buf, 16 );
+        rec.decoder_index = decoder_index;
+        rec.reason = reason;
+        if( campaign_queue )
+            replay_queue_push( campaign_queue, &rec );
+        // a single O_APPEND write keeps records whole when
+        // several campaign workers share the file
+        if( corpus_fd >= 0 && write( corpus_fd, &rec, sizeof(rec) ) != sizeof(rec) ) {
+            printf("Cannot write corpus record: %s\n", strerror(errno) );
+            close( corpus_fd );
+            corpus_fd = -1;
+        }
+    }
+}
+
+
+// Sanitizer worker: replay queued inputs until the queue is
+// closed and drained. Any sanitizer report aborts the process,
+// and the signal handler prints the input being replayed.
+
+int run_replay_worker( const char* queue_name ) {
+    replay_queue* q = replay_queue_map( queue_name, false );
+    if( !q )
+        return EXIT_FAILURE;
+    input_record rec;
+    while( replay_queue_pop( q, &rec ) ) {
+        if( rec.decoder_index >= DECODER_COUNT )
+            continue;
+        uint8_t buf[64];
+        memset( buf, 0, sizeof(buf) );
+        memcpy( buf, rec.bytes, 16 );
+        ZydisDecodedInstruction instr1;
+        ZydisDecodedOperand operands1[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+        wrapped_ZydisDecoderDecodeFull(
+            &decoders[rec.decoder_index],
+            buf,
+            64,
+            &instr1,
+            operands1,
+            ZYDIS_MAX_OPERAND_COUNT_VISIBLE,
+            ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        __atomic_fetch_add( &q->replayed, 1, __ATOMIC_RELAXED );
+    }
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Multi-version differential. Two or more Zydis
+//   shared libraries are dlopen()ed side by side and
+//   every generated input is decoded by all of them;
+//   semantic differences are reported together with
+//   the per-library decode cost.
+//
+//   The libraries must share the decoder API of the
+//   headers this fuzzer is built against. Library
+//   objects live in oversized buffers so that struct
+//   growth between versions does no harm, and only
+//   version-independent results are compared: the
+//   status, the instruction length, the mnemonic
+//   string and the formatted text.
+// ---------------------------------------------------
+
+#define MAX_DIFF_LIBRARIES 8
+#define MAX_DIFF_REPORTS 100
+
+struct diff_library {
+    const char* path;
+    void* handle;
+    ZyanU64 version;
+
+    ZyanStatus (*DecoderInit)( ZydisDecoder*, ZydisMachineMode, ZydisStackWidth );
+    ZyanStatus (*DecoderEnableMode)( ZydisDecoder*, ZydisDecoderMode, ZyanBool );
+    ZyanStatus (*DecoderDecodeFull)( const ZydisDecoder*, const void*, ZyanUSize,
+                                     ZydisDecodedInstruction*, ZydisDecodedOperand*,
+                                     ZyanU8, ZydisDecodingFlags );
+    ZyanStatus (*FormatterInit)( ZydisFormatter*, ZydisFormatterStyle );
+    ZyanStatus (*FormatterFormatInstruction)( const ZydisFormatter*, const ZydisDecodedInstruction*,
+                                              const ZydisDecodedOperand*, ZyanU8, char*, ZyanUSize,
+                                              ZyanU64, void* );
+    const char* (*MnemonicGetString)( ZydisMnemonic );
+    ZyanU64 (*GetVersion)( void );
+
+    // oversized, cache-line aligned storage for library objects
+    struct alignas(64) {
+        unsigned char decoders[DECODER_COUNT][1024];
+        unsigned char formatter[16384];
+        unsigned char instruction[4096];
+        unsigned char operands[16384];
+    } *objects;
+
+    uint64_t decode_cycles;
+    uint64_t decodes;
+
+    // results of the current input
+    ZyanStatus status;
+    uint8_t length;
+    const char* mnemonic;
+    char text[256];
+};
+
+
+static bool diff_library_resolve( diff_library* lib, const char* name, void* fn_ptr ) {
+    void* sym = dlsym( lib->handle, name );
+    if( !sym ) {
+        printf("%s: cannot resolve %s\n", lib->path, name );
+        return false;
+    }
+    memcpy( fn_ptr, &sym, sizeof(sym) );
+    return true;
+}
+
+
+// RTLD_DEEPBIND makes each library bind its internal calls to
+// its own exports rather than to the libZydis linked into the
+// fuzzer, or to another version loaded earlier.
+
+bool diff_library_open( diff_library* lib, const char* path ) {
+    int i;
+    memset( lib, 0, sizeof(*lib) );
+    lib->path = path;
+    lib->handle = dlopen( path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND );
+    if( !lib->handle ) {
+        printf("Cannot load %s: %s\n", path, dlerror() );
+        return false;
+    }
+    if( !diff_library_resolve( lib, "ZydisDecoderInit", &lib->DecoderInit )
+     || !diff_library_resolve( lib, "ZydisDecoderEnableMode", &lib->DecoderEnableMode )
+     || !diff_library_resolve( lib, "ZydisDecoderDecodeFull", &lib->DecoderDecodeFull )
+     || !diff_library_resolve( lib, "ZydisFormatterInit", &lib->FormatterInit )
+     || !diff_library_resolve( lib, "ZydisFormatterFormatInstruction", &lib->FormatterFormatInstruction )
+     || !diff_library_resolve( lib, "ZydisMnemonicGetString", &lib->MnemonicGetString )
+     || !diff_library_resolve( lib, "ZydisGetVersion", &lib->GetVersion ) )
+        return false;
+
+    lib->version = lib->GetVersion();
+    lib->objects = (decltype(lib->objects))aligned_alloc( 64, sizeof(*lib->objects) );
+    memset( lib->objects, 0, sizeof(*lib->objects) );
+    for( i=0; i<DECODER_COUNT; i++ ) {
+        ZydisDecoder* decoder = (ZydisDecoder*)lib->objects->decoders[i];
+        lib->DecoderInit( decoder, decoder_configs[i].machine_mode, decoder_configs[i].stack_width );
+        if( decoder_configs[i].knc )
+            lib->DecoderEnableMode( decoder, ZYDIS_DECODER_MODE_KNC, true );
+        if( decoder_configs[i].amd_branches )
+            lib->DecoderEnableMode( decoder, ZYDIS_DECODER_MODE_AMD_BRANCHES, true );
+    }
+    lib->FormatterInit( (ZydisFormatter*)lib->objects->formatter, ZYDIS_FORMATTER_STYLE_INTEL );
+    return true;
+}
+
+
+void diff_library_decode( diff_library* lib, int decoder_index, const uint8_t* buf ) {
+    ZydisDecodedInstruction* instr = (ZydisDecodedInstruction*)lib->objects->instruction;
+    ZydisDecodedOperand* operands = (ZydisDecodedOperand*)lib->objects->operands;
+
+    uint64_t t0 = read_cycle_counter();
+    lib->status = lib->DecoderDecodeFull(
+        (const ZydisDecoder*)lib->objects->decoders[decoder_index],
+        buf,
+        64,
+        instr,
+        operands,
+        ZYDIS_MAX_OPERAND_COUNT_VISIBLE,
+        ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+    lib->decode_cycles += read_cycle_counter() - t0;
+    lib->decodes++;
+
+    lib->length = 0;
+    lib->mnemonic = "";
+    lib->text[0] = 0;
+    if( ZYAN_SUCCESS(lib->status) ) {
+        lib->length = instr->length;
+        lib->mnemonic = lib->MnemonicGetString( instr->mnemonic );
+        if( !lib->mnemonic )
+            lib->mnemonic = "(null)";
+        if( ZYAN_FAILED( lib->FormatterFormatInstruction(
+                (const ZydisFormatter*)lib->objects->formatter,
+                instr, operands, instr->operand_count_visible,
+                lib->text, sizeof(lib->text), 0, NULL ) ) )
+            strcpy( lib->text, "(format failed)" );
+    }
+}
+
+
+static bool diff_libraries_agree( const diff_library* a, const diff_library* b ) {
+    if( a->status != b->status )
+        return false;
+    if( ZYAN_FAILED(a->status) )
+        return true;
+    return a->length == b->length
+        && !strcmp( a->mnemonic, b->mnemonic )
+        && !strcmp( a->text, b->text );
+}
+
+
+void diff_report( const diff_library* libs, int lib_count, long long diffs, long long inputs ) {
+    int i;
+    printf("%lld differences in %lld inputs\n", diffs, inputs );
+    for( i=0; i<lib_count; i++ ) {
+        printf("  v%d.%d.%d.%d %-40s %8.1f cycles/decode\n",
+            (int)(libs[i].version >> 48) & 0xFFFF, (int)(libs[i].version >> 32) & 0xFFFF,
+            (int)(libs[i].version >> 16) & 0xFFFF, (int)libs[i].version & 0xFFFF,
+            libs[i].path,
+            libs[i].decodes ? (double)libs[i].decode_cycles / libs[i].decodes : 0.0 );
+    }
+    fflush(stdout);
+}
+
+
+// ---------------------------------------------------
+//   Utility-API stage. Runs on every successful decode
+//   and puts the helpers that sit next to the decoder
+//   on the production hot path under the same load:
+//   ZydisCalcAbsoluteAddress, ZydisGetInstructionSegments,
+//   the accessed-flags tables, and the register and
+//   mnemonic lookups, checking invariants throughout.
+// ---------------------------------------------------
+
+__thread uint64_t utility_calls = 0;
+
+// The stages keep their own random state, so that enabling them
+// does not change the input stream of a given seed.
+static __thread uint64_t stage_rng = 0x243F6A8885A308D3ull;
+
+static inline uint64_t stage_rand(void) {
+    stage_rng ^= stage_rng << 13;
+    stage_rng ^= stage_rng >> 7;
+    stage_rng ^= stage_rng << 17;
+    return stage_rng;
+}
+
+void seed_stage_rng( unsigned int seed ) {
+    stage_rng = 0x243F6A8885A308D3ull ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ull);
+    if( !stage_rng )
+        stage_rng = 1;
+}
+
+
+void check_instruction_segments( const ZydisDecodedInstruction* instr ) {
+    int i;
+    ZydisInstructionSegments segments;
+    ZyanStatus status = ZydisGetInstructionSegments( instr, &segments );
+    utility_calls++;
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "ZydisGetInstructionSegments failed (0x%08X)", status );
+    if( !segments.count || segments.count > ZYDIS_MAX_INSTRUCTION_LENGTH )
+        invariant_failed( "segment count %d", segments.count );
+    int offset = 0;
+    for( i=0; i<segments.count; i++ ) {
+        if( segments.segments[i].type == ZYDIS_INSTR_SEGMENT_NONE
+         || segments.segments[i].type > ZYDIS_INSTR_SEGMENT_MAX_VALUE )
+            invariant_failed( "segment %d has type %d", i, segments.segments[i].type );
+        if( segments.segments[i].offset != offset || !segments.segments[i].size )
+            invariant_failed( "segment %d at offset %d size %d, expected offset %d",
+                i, segments.segments[i].offset, segments.segments[i].size, offset );
+        offset += segments.segments[i].size;
+    }
+    if( offset != instr->length )
+        invariant_failed( "segment sizes sum to %d, instruction length is %d",
+            offset, instr->length );
+}
+
+
+// ZydisCalcAbsoluteAddress results must match exactly, in all 64
+// bits, so that a target truncated to the wrong width shows up.
+
+static inline uint64_t address_width_mask( const ZydisDecodedInstruction* instr, uint64_t address ) {
+    if( instr->address_width == 16 )
+        return address & 0xFFFF;
+    if( instr->address_width == 32 )
+        return address & 0xFFFFFFFF;
+    return address;
+}
+
+
+void check_absolute_addresses(
+    const ZydisDecodedInstruction* instr,
+    const ZydisDecodedOperand* operands ) {
+    int i, k;
+    const uint64_t runtime_addresses[4] = {
+        0,
+        stage_rand(),
+        0xFFFFFFFFFFFFFFF0ull,
+        0x7FFFFFF0ull
+    };
+    for( i=0; i<instr->operand_count_visible; i++ ) {
+        const ZydisDecodedOperand* op = &operands[i];
+        for( k=0; k<4; k++ ) {
+            uint64_t result;
+            ZyanStatus status = ZydisCalcAbsoluteAddress( instr, op, runtime_addresses[k], &result );
+            utility_calls++;
+            if( ZYAN_FAILED(status) )
+                continue;
+            // branch targets wrap at the operand width (32 bits outside
+            // 64-bit mode), memory addresses at the address width
+            uint64_t expected;
+            if( op->type == ZYDIS_OPERAND_TYPE_IMMEDIATE && op->imm.is_relative ) {
+                expected = runtime_addresses[k] + instr->length + op->imm.value.u;
+                if( instr->operand_width == 16 )
+                    expected &= 0xFFFF;
+                else if( instr->machine_mode != ZYDIS_MACHINE_MODE_LONG_64 )
+                    expected &= 0xFFFFFFFF;
+            } else if( op->type == ZYDIS_OPERAND_TYPE_MEMORY
+                    && ( op->mem.base == ZYDIS_REGISTER_RIP || op->mem.base == ZYDIS_REGISTER_EIP )
+                    && op->mem.index == ZYDIS_REGISTER_NONE ) {
+                expected = address_width_mask( instr,
+                    runtime_addresses[k] + instr->length + op->mem.disp.value );
+            } else if( op->type == ZYDIS_OPERAND_TYPE_MEMORY
+                    && op->mem.base == ZYDIS_REGISTER_NONE
+                    && op->mem.index == ZYDIS_REGISTER_NONE ) {
+                expected = address_width_mask( instr, op->mem.disp.value );
+            } else {
+                continue;
+            }
+            if( result != expected )
+                invariant_failed( "operand %d at runtime address 0x%llX: absolute address 0x%llX, expected 0x%llX",
+                    i, (unsigned long long)runtime_addresses[k],
+                    (unsigned long long)result, (unsigned long long)expected );
+        }
+    }
+}
+
+
+// A flag has a single action per instruction, so the modified,
+// set-to-0, set-to-1 and undefined sets never overlap.
+
+template<typename flags_type>
+void check_flag_sets( const flags_type* flags, const char* what ) {
+    if( !flags )
+        return;
+    if( (flags->modified & flags->set_0) || (flags->modified & flags->set_1)
+     || (flags->modified & flags->undefined) || (flags->set_0 & flags->set_1)
+     || (flags->set_0 & flags->undefined) || (flags->set_1 & flags->undefined) )
+        invariant_failed( "overlapping %s sets: modified %X set_0 %X set_1 %X undefined %X",
+            what, flags->modified, flags->set_0, flags->set_1, flags->undefined );
+}
+
+
+void check_register( ZydisMachineMode mode, ZydisRegister reg ) {
+    if( reg == ZYDIS_REGISTER_NONE )
+        return;
+    const char* name = ZydisRegisterGetString( reg );
+    if( !name || !name[0] )
+        invariant_failed( "register %d has no name", reg );
+    ZydisRegisterClass regclass = ZydisRegisterGetClass( reg );
+    if( regclass == ZYDIS_REGCLASS_INVALID || regclass > ZYDIS_REGCLASS_MAX_VALUE )
+        invariant_failed( "register %s has class %d", name, regclass );
+    ZyanI8 id = ZydisRegisterGetId( reg );
+    switch( regclass ) {
+        case ZYDIS_REGCLASS_FLAGS:
+        case ZYDIS_REGCLASS_IP:
+            break;  // single-member classes without encodable ids
+        default:
+            if( id < 0 || ZydisRegisterEncode( regclass, id ) != reg )
+                invariant_failed( "register %s (class %d, id %d) does not round-trip through ZydisRegisterEncode",
+                    name, regclass, id );
+            break;
+    }
+    if( !ZydisRegisterGetWidth( mode, reg ) )
+        invariant_failed( "register %s has zero width in machine mode %d", name, mode );
+    if( ZydisRegisterGetLargestEnclosing( mode, reg ) == ZYDIS_REGISTER_NONE )
+        invariant_failed( "register %s has no enclosing register in machine mode %d", name, mode );
+    utility_calls += 6;
+}
+
+
+void check_utility_apis(
+    const ZydisDecodedInstruction* instr,
+    const ZydisDecodedOperand* operands ) {
+    int i;
+    check_instruction_segments( instr );
+    check_absolute_addresses( instr, operands );
+    check_flag_sets( instr->cpu_flags, "CPU flag" );
+    check_flag_sets( instr->fpu_flags, "FPU flag" );
+
+    const char* mnemonic = ZydisMnemonicGetString( instr->mnemonic );
+    if( !mnemonic || !mnemonic[0] )
+        invariant_failed( "mnemonic %d has no name", instr->mnemonic );
+    utility_calls++;
+
+    for( i=0; i<instr->operand_count_visible; i++ ) {
+        const ZydisDecodedOperand* op = &operands[i];
+        switch( op->type ) {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                check_register( instr->machine_mode, op->reg.value );
+                break;
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                check_register( instr->machine_mode, op->mem.segment );
+                check_register( instr->machine_mode, op->mem.base );
+                check_register( instr->machine_mode, op->mem.index );
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+
+// ---------------------------------------------------
+//   Formatter token-stream stage. Tokenizes every
+//   successful decode into a reusable buffer, walks
+//   the token chain checking each token's type and
+//   value, and cross-checks the concatenated token
+//   text against ZydisFormatterFormatInstruction().
+// ---------------------------------------------------
+
+__thread uint64_t tokens_walked = 0;
+__thread uint64_t token_streams = 0;
+__thread uint64_t token_cycles = 0;    // tokenize and walk, without the cross-check
+
+static __thread uint8_t token_buffer[1024];
+
+
+static inline bool token_type_valid( ZydisTokenType type ) {
+    return ( type >= ZYDIS_TOKEN_WHITESPACE && type <= ZYDIS_TOKEN_SYMBOL )
+        || type >= ZYDIS_TOKEN_USER;
+}
+
+
+void check_token_stream(
+    const ZydisFormatter* formatter,
+    const ZydisDecodedInstruction* instr,
+    const ZydisDecodedOperand* operands ) {
+    const ZydisFormatterToken* token;
+    uint64_t t_begin = read_cycle_counter();
+    ZyanStatus status = ZydisFormatterTokenizeInstruction(
+        formatter, instr, operands, instr->operand_count_visible,
+        token_buffer, sizeof(token_buffer), 0, &token, NULL );
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "ZydisFormatterTokenizeInstruction failed (0x%08X)", status );
+
+    char joined[256];
+    size_t joined_len = 0;
+    int count = 0;
+    do {
+        ZydisTokenType type;
+        ZyanConstCharPointer value;
+        status = ZydisFormatterTokenGetValue( token, &type, &value );
+        if( ZYAN_FAILED(status) )
+            invariant_failed( "ZydisFormatterTokenGetValue failed (0x%08X) on token %d", status, count );
+        if( !token_type_valid( type ) )
+            invariant_failed( "token %d has type 0x%02X", count, type );
+        if( !value || (const uint8_t*)value < token_buffer
+         || (const uint8_t*)value >= token_buffer + sizeof(token_buffer) )
+            invariant_failed( "token %d value lies outside the token buffer", count );
+        size_t len = strnlen( value, token_buffer + sizeof(token_buffer) - (const uint8_t*)value );
+        if( joined_len + len >= sizeof(joined) || ++count > (int)sizeof(token_buffer) )
+            invariant_failed( "token chain does not terminate" );
+        memcpy( joined + joined_len, value, len );
+        joined_len += len;
+    } while( ZYAN_SUCCESS( ZydisFormatterTokenNext( &token ) ) );
+    joined[joined_len] = 0;
+    token_cycles += read_cycle_counter() - t_begin;
+
+    char text[256];
+    status = ZydisFormatterFormatInstruction(
+        formatter, instr, operands, instr->operand_count_visible,
+        text, sizeof(text), 0, NULL );
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "ZydisFormatterFormatInstruction failed (0x%08X)", status );
+    if( strcmp( joined, text ) )
+        invariant_failed( "token text \"%s\" differs from formatted text \"%s\"", joined, text );
+
+    tokens_walked += count;
+    token_streams++;
+}
+
+
+
+// ---------------------------------------------------
+//   Formatter hook stage. A pool of formatters is set
+//   up front, each with a randomized set of hooks
+//   installed through ZydisFormatterSetHook: hooks
+//   that call the original, hooks that return without
+//   printing anything, hooks that skip every other
+//   operand, and hooks that return
+//   ZYDIS_STATUS_SKIP_TOKEN. Successful decodes are
+//   formatted by a formatter picked from the pool, so
+//   hook dispatch is exercised at formatter speed.
+//   Now and then one pool entry is rebuilt with a new
+//   configuration, except under libFuzzer, where the
+//   pool must not carry state from one input to the
+//   next.
+// ---------------------------------------------------
+
+enum hook_behavior {
+    HOOK_NOT_INSTALLED,
+    HOOK_CALL_ORIGINAL,
+    HOOK_PASS_THROUGH,          // return success without output
+    HOOK_SKIP_ODD_OPERANDS,     // skip operands with odd ids, else original
+    HOOK_SKIP_TOKEN,            // always return ZYDIS_STATUS_SKIP_TOKEN
+    HOOK_BEHAVIOR_COUNT
+};
+
+#define HOOK_FUNCTION_COUNT (ZYDIS_FORMATTER_FUNC_MAX_VALUE + 1)
+#define HOOKED_FORMATTER_POOL 16
+#define HOOKED_FORMATTER_REBUILD_INTERVAL 65536
+
+struct hooked_formatter {
+    ZydisFormatter formatter;
+    uint8_t behavior[HOOK_FUNCTION_COUNT];
+    const void* original[HOOK_FUNCTION_COUNT];
+};
+
+__thread hooked_formatter* hooked_formatters = NULL;
+__thread int hook_rebuild_countdown = 0;
+int hook_rebuild_interval = HOOKED_FORMATTER_REBUILD_INTERVAL;     // 0: never
+__thread uint64_t hook_calls = 0;
+__thread uint64_t hooked_formats = 0;
+__thread uint64_t hooked_format_failures = 0;
+
+
+// The formatter context carries the hooked_formatter as its
+// user data; this decides whether the original gets called.
+
+static inline bool hook_forward(
+    const hooked_formatter* hf,
+    int function,
+    const ZydisFormatterContext* context,
+    ZyanStatus* status ) {
+    hook_calls++;
+    switch( hf->behavior[function] ) {
+        case HOOK_PASS_THROUGH:
+            *status = ZYAN_STATUS_SUCCESS;
+            return false;
+        case HOOK_SKIP_TOKEN:
+            *status = ZYDIS_STATUS_SKIP_TOKEN;
+            return false;
+        case HOOK_SKIP_ODD_OPERANDS:
+            if( context->operand && (context->operand->id & 1) ) {
+                *status = ZYDIS_STATUS_SKIP_TOKEN;
+                return false;
+            }
+            break;
+        default:
+            break;
+    }
+    *status = ZYAN_STATUS_SUCCESS;
+    return hf->original[function] != NULL;
+}
+
+
+template<int FUNCTION>
+ZyanStatus hook_generic(
+    const ZydisFormatter* formatter,
+    ZydisFormatterBuffer* buffer,
+    ZydisFormatterContext* context ) {
+    const hooked_formatter* hf = (const hooked_formatter*)context->user_data;
+    ZyanStatus status;
+    if( !hook_forward( hf, FUNCTION, context, &status ) )
+        return status;
+    return ((ZydisFormatterFunc)hf->original[FUNCTION])( formatter, buffer, context );
+}
+
+
+ZyanStatus hook_print_register(
+    const ZydisFormatter* formatter,
+    ZydisFormatterBuffer* buffer,
+    ZydisFormatterContext* context,
+    ZydisRegister reg ) {
+    const hooked_formatter* hf = (const hooked_formatter*)context->user_data;
+    ZyanStatus status;
+    if( !hook_forward( hf, ZYDIS_FORMATTER_FUNC_PRINT_REGISTER, context, &status ) )
+        return status;
+    return ((ZydisFormatterRegisterFunc)hf->original[ZYDIS_FORMATTER_FUNC_PRINT_REGISTER])(
+        formatter, buffer, context, reg );
+}
+
+
+ZyanStatus hook_print_decorator(
+    const ZydisFormatter* formatter,
+    ZydisFormatterBuffer* buffer,
+    ZydisFormatterContext* context,
+    ZydisDecorator decorator ) {
+    const hooked_formatter* hf = (const hooked_formatter*)context->user_data;
+    ZyanStatus status;
+    if( !hook_forward( hf, ZYDIS_FORMATTER_FUNC_PRINT_DECORATOR, context, &status ) )
+        return status;
+    return ((ZydisFormatterDecoratorFunc)hf->original[ZYDIS_FORMATTER_FUNC_PRINT_DECORATOR])(
+        formatter, buffer, context, decorator );
+}
+
+
+static const void* hook_function_for( int function ) {
+    switch( function ) {
+        case ZYDIS_FORMATTER_FUNC_PRE_INSTRUCTION:    return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRE_INSTRUCTION>;
+        case ZYDIS_FORMATTER_FUNC_POST_INSTRUCTION:   return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_POST_INSTRUCTION>;
+        case ZYDIS_FORMATTER_FUNC_FORMAT_INSTRUCTION: return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_FORMAT_INSTRUCTION>;
+        case ZYDIS_FORMATTER_FUNC_PRE_OPERAND:        return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRE_OPERAND>;
+        case ZYDIS_FORMATTER_FUNC_POST_OPERAND:       return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_POST_OPERAND>;
+        case ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_REG: return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_REG>;
+        case ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_MEM: return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_MEM>;
+        case ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_PTR: return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_PTR>;
+        case ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_IMM: return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_FORMAT_OPERAND_IMM>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_MNEMONIC:     return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_MNEMONIC>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_REGISTER:     return (const void*)&hook_print_register;
+        case ZYDIS_FORMATTER_FUNC_PRINT_ADDRESS_ABS:  return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_ADDRESS_ABS>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_ADDRESS_REL:  return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_ADDRESS_REL>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_DISP:         return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_DISP>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_IMM:          return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_IMM>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_TYPECAST:     return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_TYPECAST>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_SEGMENT:      return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_SEGMENT>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_PREFIXES:     return (const void*)&hook_generic<ZYDIS_FORMATTER_FUNC_PRINT_PREFIXES>;
+        case ZYDIS_FORMATTER_FUNC_PRINT_DECORATOR:    return (const void*)&hook_print_decorator;
+        default:                                      return NULL;
+    }
+}
+
+
+// Each hook is left alone with probability 1/2; installed hooks
+// mostly call the original, so that output is still produced.
+
+void build_hooked_formatter( hooked_formatter* hf ) {
+    int i;
+    static const ZydisFormatterStyle styles[3] = {
+        ZYDIS_FORMATTER_STYLE_ATT,
+        ZYDIS_FORMATTER_STYLE_INTEL,
+        ZYDIS_FORMATTER_STYLE_INTEL_MASM
+    };
+    memset( hf, 0, sizeof(*hf) );
+    ZydisFormatterInit( &hf->formatter, styles[stage_rand() % 3] );
+    for( i=0; i<HOOK_FUNCTION_COUNT; i++ ) {
+        uint64_t r = stage_rand();
+        if( r & 1 )
+            continue;
+        switch( (r >> 1) % 8 ) {
+            case 0: case 1: case 2: case 3:
+                hf->behavior[i] = HOOK_CALL_ORIGINAL;     break;
+            case 4: case 5:
+                hf->behavior[i] = HOOK_SKIP_ODD_OPERANDS; break;
+            case 6:
+                hf->behavior[i] = HOOK_PASS_THROUGH;      break;
+            default:
+                hf->behavior[i] = HOOK_SKIP_TOKEN;        break;
+        }
+        const void* callback = hook_function_for( i );
+        if( ZYAN_FAILED( ZydisFormatterSetHook( &hf->formatter, (ZydisFormatterFunction)i, &callback ) ) ) {
+            hf->behavior[i] = HOOK_NOT_INSTALLED;
+            continue;
+        }
+        hf->original[i] = callback;
+    }
+}
+
+
+// Builds the calling thread's pool, or rebuilds all of it.
+
+void init_hooked_formatters(void) {
+    int i;
+    if( !hooked_formatters )
+        hooked_formatters = (hooked_formatter*)calloc( HOOKED_FORMATTER_POOL, sizeof(hooked_formatter) );
+    for( i=0; i<HOOKED_FORMATTER_POOL; i++ )
+        build_hooked_formatter( &hooked_formatters[i] );
+    hook_rebuild_countdown = hook_rebuild_interval;
+}
+
+
+void check_hooked_formatting(
+    const ZydisDecodedInstruction* instr,
+    const ZydisDecodedOperand* operands ) {
+    hooked_formats++;
+    if( hook_rebuild_interval && --hook_rebuild_countdown == 0 ) {
+        hook_rebuild_countdown = hook_rebuild_interval;
+        build_hooked_formatter( &hooked_formatters[stage_rand() % HOOKED_FORMATTER_POOL] );
+    }
+    hooked_formatter* hf = &hooked_formatters[stage_rand() % HOOKED_FORMATTER_POOL];
+
+    char text[256];
+    ZyanStatus status = ZydisFormatterFormatInstruction(
+        &hf->formatter, instr, operands, instr->operand_count_visible,
+        text, sizeof(text), stage_rand(), hf );
+    if( ZYAN_FAILED(status) ) {
+        hooked_format_failures++;
+    } else if( strnlen( text, sizeof(text) ) == sizeof(text) ) {
+        invariant_failed( "hooked formatter output is not terminated" );
+    }
+
+    const ZydisFormatterToken* token;
+    status = ZydisFormatterTokenizeInstruction(
+        &hf->formatter, instr, operands, instr->operand_count_visible,
+        token_buffer, sizeof(token_buffer), stage_rand(), &token, hf );
+    if( ZYAN_FAILED(status) ) {
+        hooked_format_failures++;
+        return;
+    }
+    int count = 0;
+    do {
+        ZydisTokenType type;
+        ZyanConstCharPointer value;
+        if( ZYAN_FAILED( ZydisFormatterTokenGetValue( token, &type, &value ) ) )
+            invariant_failed( "ZydisFormatterTokenGetValue failed on hooked token %d", count );
+        if( ++count > (int)sizeof(token_buffer) )
+            invariant_failed( "hooked token chain does not terminate" );
+    } while( ZYAN_SUCCESS( ZydisFormatterTokenNext( &token ) ) );
+}
+
+
+
+// ---------------------------------------------------
+//   Encoder fuzzing. Structured random
+//   ZydisEncoderRequest values - random mnemonic,
+//   operand kinds, registers drawn by class, memory
+//   forms, immediates, branch types and hints - are
+//   fed to ZydisEncoderEncodeInstruction and
+//   ZydisEncoderEncodeInstructionAbsolute. Every
+//   successful encoding is decoded again and must
+//   give back the requested mnemonic and the encoded
+//   length; the decoded instruction must also convert
+//   back into a request that encodes. NOP fills of
+//   random length must decode as NOPs end to end.
+// ---------------------------------------------------
+
+struct encoder_stats {
+    uint64_t requests;
+    uint64_t encoded;
+    uint64_t absolute;
+    uint64_t nop_fills;
+};
+
+encoder_stats encoder_counts;
+const ZydisEncoderRequest* current_encoder_request = NULL;
+
+
+void print_encoder_request(void) {
+    int i;
+    const ZydisEncoderRequest* req = current_encoder_request;
+    if( !req )
+        return;
+    const char* name = ZydisMnemonicGetString( req->mnemonic );
+    printf("Encoder request: mode %d, mnemonic %d (%s), encodings 0x%X, prefixes 0x%llX,\n",
+        req->machine_mode, req->mnemonic, name ? name : "?", req->allowed_encodings,
+        (unsigned long long)req->prefixes );
+    printf("  branch type %d width %d, address size hint %d, operand size hint %d\n",
+        req->branch_type, req->branch_width, req->address_size_hint, req->operand_size_hint );
+    for( i=0; i<req->operand_count && i<ZYDIS_ENCODER_MAX_OPERANDS; i++ ) {
+        const ZydisEncoderOperand* op = &req->operands[i];
+        switch( op->type ) {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                printf("  operand %d: register %d is4 %d\n", i, op->reg.value, op->reg.is4 );
+                break;
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                printf("  operand %d: memory base %d index %d scale %d disp 0x%llX size %d\n",
+                    i, op->mem.base, op->mem.index, op->mem.scale,
+                    (unsigned long long)op->mem.displacement, op->mem.size );
+                break;
+            case ZYDIS_OPERAND_TYPE_POINTER:
+                printf("  operand %d: pointer %04X:%08X\n", i, op->ptr.segment, op->ptr.offset );
+                break;
+            default:
+                printf("  operand %d: immediate 0x%llX\n", i, (unsigned long long)op->imm.u );
+                break;
+        }
+    }
+}
+
+
+static inline uint64_t rand64(void) {
+    return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
+
+// Values of varied magnitude: zero, small, and full 8, 16, 32
+// or 64-bit random values, sign-extended half of the time.
+
+static int64_t random_magnitude(void) {
+    uint64_t r = rand64();
+    switch( rand() % 6 ) {
+        case 0:  return 0;
+        case 1:  return (int64_t)(r % 16);
+        case 2:  return (int8_t)r;
+        case 3:  return (int16_t)r;
+        case 4:  return (int32_t)r;
+        default: return (int64_t)r;
+    }
+}
+
+
+static const ZydisRegisterClass encoder_register_classes[] = {
+    ZYDIS_REGCLASS_GPR8,  ZYDIS_REGCLASS_GPR16, ZYDIS_REGCLASS_GPR32, ZYDIS_REGCLASS_GPR64,
+    ZYDIS_REGCLASS_GPR32, ZYDIS_REGCLASS_GPR64, ZYDIS_REGCLASS_XMM,   ZYDIS_REGCLASS_YMM,
+    ZYDIS_REGCLASS_ZMM,   ZYDIS_REGCLASS_XMM,   ZYDIS_REGCLASS_MASK,  ZYDIS_REGCLASS_MMX,
+    ZYDIS_REGCLASS_X87,   ZYDIS_REGCLASS_SEGMENT, ZYDIS_REGCLASS_CONTROL, ZYDIS_REGCLASS_DEBUG,
+    ZYDIS_REGCLASS_BOUND, ZYDIS_REGCLASS_TMM
+};
+
+
+// Mostly registers of a common class with a small id, so that
+// requests have a fair chance of being encodable; otherwise any
+// register value at all.
+
+static ZydisRegister random_register( int bits ) {
+    if( !(rand() % 16) )
+        return (ZydisRegister)(1 + rand() % ZYDIS_REGISTER_MAX_VALUE);
+    ZydisRegisterClass regclass = encoder_register_classes[
+        rand() % (sizeof(encoder_register_classes)/sizeof(encoder_register_classes[0])) ];
+    int id = rand() % (bits == 64 ? 32 : 8);
+    ZydisRegister reg = ZydisRegisterEncode( regclass, id );
+    return reg != ZYDIS_REGISTER_NONE ? reg : ZydisRegisterEncode( regclass, 0 );
+}
+
+
+static ZydisRegister random_address_register( int bits ) {
+    static const ZydisRegisterClass gpr_for_bits[3] = {
+        ZYDIS_REGCLASS_GPR16, ZYDIS_REGCLASS_GPR32, ZYDIS_REGCLASS_GPR64
+    };
+    int r = rand() % 16;
+    if( r < 3 )
+        return ZYDIS_REGISTER_NONE;
+    if( r == 3 )
+        return bits == 64 ? ZYDIS_REGISTER_RIP : ZYDIS_REGISTER_EIP;
+    if( r == 4 )
+        return random_register( bits );     // VSIB and odd cases
+    int width = r < 10 ? ( bits == 16 ? 0 : bits == 32 ? 1 : 2 ) : rand() % 3;
+    return ZydisRegisterEncode( gpr_for_bits[width], rand() % (bits == 64 ? 16 : 8) );
+}
+
+
+void generate_encoder_request( ZydisEncoderRequest* req, int* decoder_index ) {
+    int i;
+    static const uint16_t memory_sizes[] = { 0, 1, 2, 4, 6, 8, 10, 16, 32, 64, 0, 4, 8 };
+    memset( req, 0, sizeof(*req) );
+
+    int bits;
+    switch( rand() % 3 ) {
+        case 0:  bits = 16; req->machine_mode = ZYDIS_MACHINE_MODE_LEGACY_16; *decoder_index = DECODER_X86_16; break;
+        case 1:  bits = 32; req->machine_mode = ZYDIS_MACHINE_MODE_LEGACY_32; *decoder_index = DECODER_X86_32; break;
+        default: bits = 64; req->machine_mode = ZYDIS_MACHINE_MODE_LONG_64;   *decoder_index = DECODER_X86_64; break;
+    }
+    req->mnemonic = (ZydisMnemonic)(1 + rand() % ZYDIS_MNEMONIC_MAX_VALUE);
+    if( !(rand() % 4) )
+        req->allowed_encodings = (ZydisEncodableEncoding)(rand() & 0x3F);
+    if( !(rand() % 4) )
+        req->prefixes = rand64() & rand64() & ZYDIS_ENCODABLE_PREFIXES;
+    if( !(rand() % 4) ) {
+        req->branch_type  = (ZydisBranchType)(rand() % (ZYDIS_BRANCH_TYPE_MAX_VALUE + 1));
+        req->branch_width = (ZydisBranchWidth)(rand() % (ZYDIS_BRANCH_WIDTH_MAX_VALUE + 1));
+    }
+    if( !(rand() % 4) )
+        req->address_size_hint = (ZydisAddressSizeHint)(rand() % (ZYDIS_ADDRESS_SIZE_HINT_MAX_VALUE + 1));
+    if( !(rand() % 4) )
+        req->operand_size_hint = (ZydisOperandSizeHint)(rand() % (ZYDIS_OPERAND_SIZE_HINT_MAX_VALUE + 1));
+    if( !(rand() % 8) ) {
+        req->evex.broadcast    = (ZydisBroadcastMode)(rand() % (ZYDIS_BROADCAST_MODE_MAX_VALUE + 1));
+        req->evex.rounding     = (ZydisRoundingMode)(rand() % (ZYDIS_ROUNDING_MODE_MAX_VALUE + 1));
+        req->evex.sae          = rand() & 1;
+        req->evex.zeroing_mask = rand() & 1;
+    }
+    if( !(rand() % 16) ) {
+        req->mvex.broadcast     = (ZydisBroadcastMode)(rand() % (ZYDIS_BROADCAST_MODE_MAX_VALUE + 1));
+        req->mvex.conversion    = (ZydisConversionMode)(rand() % (ZYDIS_CONVERSION_MODE_MAX_VALUE + 1));
+        req->mvex.rounding      = (ZydisRoundingMode)(rand() % (ZYDIS_ROUNDING_MODE_MAX_VALUE + 1));
+        req->mvex.swizzle       = (ZydisSwizzleMode)(rand() % (ZYDIS_SWIZZLE_MODE_MAX_VALUE + 1));
+        req->mvex.sae           = rand() & 1;
+        req->mvex.eviction_hint = rand() & 1;
+    }
+
+    // 0 to 5 operands, biased towards 1 to 3
+    static const uint8_t operand_counts[16] = { 0, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5 };
+    req->operand_count = operand_counts[rand() % 16];
+    for( i=0; i<req->operand_count; i++ ) {
+        ZydisEncoderOperand* op = &req->operands[i];
+        switch( rand() % 8 ) {
+            case 0: case 1: case 2:
+                op->type = ZYDIS_OPERAND_TYPE_REGISTER;
+                op->reg.value = random_register( bits );
+                op->reg.is4 = !(rand() % 16);
+                break;
+            case 3: case 4:
+                op->type = ZYDIS_OPERAND_TYPE_MEMORY;
+                op->mem.base  = random_address_register( bits );
+                op->mem.index = random_address_register( bits );
+                op->mem.scale = op->mem.index == ZYDIS_REGISTER_NONE ? 0 : 1 << (rand() & 3);
+                op->mem.displacement = random_magnitude();
+                op->mem.size  = memory_sizes[rand() % (sizeof(memory_sizes)/sizeof(memory_sizes[0]))];
+                break;
+            case 5:
+                op->type = ZYDIS_OPERAND_TYPE_POINTER;
+                op->ptr.segment = rand();
+                op->ptr.offset  = rand64();
+                break;
+            default:
+                op->type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
+                op->imm.s = random_magnitude();
+                break;
+        }
+    }
+}
+
+
+void check_encoding(
+    const ZydisEncoderRequest* req,
+    int decoder_index,
+    const uint8_t* encoded,
+    ZyanUSize length ) {
+    uint8_t buf[16];
+    memset( buf, 0, sizeof(buf) );
+    memcpy( buf, encoded, length );
+
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    ZyanStatus status = wrapped_ZydisDecoderDecodeFull(
+        &decoders[decoder_index], buf, length, &instr,
+        operands, ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "encoder output does not decode (0x%08X)", status );
+    if( instr.length != length )
+        invariant_failed( "encoder produced %d bytes, decoder consumed %d", (int)length, instr.length );
+    if( instr.mnemonic != req->mnemonic )
+        invariant_failed( "encoded %s, decoded %s",
+            ZydisMnemonicGetString( req->mnemonic ), ZydisMnemonicGetString( instr.mnemonic ) );
+
+    ZydisEncoderRequest again;
+    status = ZydisEncoderDecodedInstructionToEncoderRequest(
+        &instr, operands, instr.operand_count_visible, &again );
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "decoded encoder output does not convert to a request (0x%08X)", status );
+    uint8_t reencoded[ZYDIS_MAX_INSTRUCTION_LENGTH];
+    ZyanUSize relength = sizeof(reencoded);
+    status = ZydisEncoderEncodeInstruction( &again, reencoded, &relength );
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "decoded encoder output does not encode again (0x%08X)", status );
+}
+
+
+void check_nop_fill(void) {
+    uint8_t buf[80];
+    ZyanUSize length = 1 + rand() % 64;
+    memset( buf, 0xCC, sizeof(buf) );
+    ZyanStatus status = ZydisEncoderNopFill( buf, length );
+    encoder_counts.nop_fills++;
+    if( ZYAN_FAILED(status) )
+        invariant_failed( "ZydisEncoderNopFill of %d bytes failed (0x%08X)", (int)length, status );
+    if( buf[length] != 0xCC )
+        invariant_failed( "ZydisEncoderNopFill of %d bytes wrote past the end", (int)length );
+
+    ZyanUSize offset = 0;
+    while( offset < length ) {
+        ZydisDecodedInstruction instr;
+        ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+        status = wrapped_ZydisDecoderDecodeFull(
+            &decoders[DECODER_X86_64], buf + offset, length - offset, &instr,
+            operands, ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        if( ZYAN_FAILED(status) || instr.mnemonic != ZYDIS_MNEMONIC_NOP )
+            invariant_failed( "NOP fill of %d bytes has a non-NOP at offset %d", (int)length, (int)offset );
+        offset += instr.length;
+    }
+}
+
+
+void run_encoder_iteration(void) {
+    ZydisEncoderRequest req;
+    int decoder_index;
+    generate_encoder_request( &req, &decoder_index );
+    current_encoder_request = &req;
+
+    uint8_t encoded[ZYDIS_MAX_INSTRUCTION_LENGTH];
+    ZyanUSize length = sizeof(encoded);
+    ZyanStatus status;
+    if( rand() & 1 ) {
+        status = ZydisEncoderEncodeInstruction( &req, encoded, &length );
+    } else {
+        ZydisEncoderRequest absolute = req;
+        current_encoder_request = &absolute;
+        status = ZydisEncoderEncodeInstructionAbsolute( &absolute, encoded, &length, rand64() );
+        encoder_counts.absolute++;
+    }
+    encoder_counts.requests++;
+    if( ZYAN_SUCCESS(status) ) {
+        if( !length || length > ZYDIS_MAX_INSTRUCTION_LENGTH )
+            invariant_failed( "encoder reports a length of %d", (int)length );
+        encoder_counts.encoded++;
+        check_encoding( &req, decoder_index, encoded, length );
+    }
+    current_encoder_request = NULL;
+
+    if( !(rand() % 16) )
+        check_nop_fill();
+}
+
+
+
+// ---------------------------------------------------
+//   Encoder-synthesized seeds. At startup, the encoder
+//   is asked for every (mnemonic, operand form, machine
+//   mode) combination from a fixed set of operand-form
+//   templates; every request that encodes becomes a
+//   seed. The fuzz loop then mutates around the seeds
+//   (prefix insertion, bit flips, byte replacement) as
+//   a second input source next to generate_rand_instr,
+//   which rarely reaches long-tail mnemonics.
+// ---------------------------------------------------
+
+enum seed_operand_kind {
+    SEED_GPR8, SEED_GPR16, SEED_GPR32, SEED_GPR64,
+    SEED_XMM, SEED_YMM, SEED_ZMM, SEED_MASK, SEED_MMX, SEED_X87,
+    SEED_SEGMENT, SEED_CONTROL, SEED_DEBUG, SEED_BOUND, SEED_TMM,
+    SEED_REGISTER_KINDS,
+    SEED_MEM8 = SEED_REGISTER_KINDS, SEED_MEM16, SEED_MEM32, SEED_MEM64,
+    SEED_MEM80, SEED_MEM128, SEED_MEM256, SEED_MEM512,
+    SEED_IMM8, SEED_IMM16, SEED_IMM32,
+    SEED_OPERAND_KINDS
+};
+
+static const ZydisRegisterClass seed_register_classes[SEED_REGISTER_KINDS] = {
+    ZYDIS_REGCLASS_GPR8, ZYDIS_REGCLASS_GPR16, ZYDIS_REGCLASS_GPR32, ZYDIS_REGCLASS_GPR64,
+    ZYDIS_REGCLASS_XMM, ZYDIS_REGCLASS_YMM, ZYDIS_REGCLASS_ZMM, ZYDIS_REGCLASS_MASK,
+    ZYDIS_REGCLASS_MMX, ZYDIS_REGCLASS_X87, ZYDIS_REGCLASS_SEGMENT, ZYDIS_REGCLASS_CONTROL,
+    ZYDIS_REGCLASS_DEBUG, ZYDIS_REGCLASS_BOUND, ZYDIS_REGCLASS_TMM
+};
+
+static const uint16_t seed_memory_sizes[8] = { 1, 2, 4, 8, 10, 16, 32, 64 };
+
+struct seed_input {
+    uint8_t bytes[ZYDIS_MAX_INSTRUCTION_LENGTH];
+    uint8_t length;
+    uint8_t bits;
+};
+
+seed_input* seeds = NULL;
+size_t seed_count = 0;
+size_t seed_capacity = 0;
+uint64_t seed_requests = 0;     // encoder calls made by synthesize_seeds
+
+
+// Registers take the id of their operand position (rax, rcx,
+// rdx...), so that both the fixed-accumulator and the generic
+// forms get hit; mask registers skip k0, segments use ds.
+
+void fill_seed_operand( ZydisEncoderOperand* op, int kind, int bits, int position ) {
+    static const ZydisRegister base_for_bits[3] = {
+        ZYDIS_REGISTER_BX, ZYDIS_REGISTER_EBX, ZYDIS_REGISTER_RBX
+    };
+    memset( op, 0, sizeof(*op) );
+    if( kind < SEED_REGISTER_KINDS ) {
+        int id = position;
+        if( kind == SEED_MASK )
+            id = position + 1;
+        else if( kind == SEED_SEGMENT )
+            id = 3;
+        op->type = ZYDIS_OPERAND_TYPE_REGISTER;
+        op->reg.value = ZydisRegisterEncode( seed_register_classes[kind], id );
+    } else if( kind < SEED_IMM8 ) {
+        op->type = ZYDIS_OPERAND_TYPE_MEMORY;
+        op->mem.base = base_for_bits[ bits == 16 ? 0 : bits == 32 ? 1 : 2 ];
+        op->mem.displacement = 0x10;
+        op->mem.size = seed_memory_sizes[kind - SEED_MEM8];
+    } else {
+        static const int64_t values[3] = { 0x12, 0x1234, 0x12345678 };
+        op->type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
+        op->imm.s = values[kind - SEED_IMM8];
+    }
+}
+
+
+static bool try_seed_form(
+    ZydisEncoderRequest* req,
+    int bits,
+    const int* kinds,
+    int count ) {
+    int i;
+    req->operand_count = count;
+    for( i=0; i<count; i++ )
+        fill_seed_operand( &req->operands[i], kinds[i], bits, i );
+
+    uint8_t encoded[ZYDIS_MAX_INSTRUCTION_LENGTH];
+    ZyanUSize length = sizeof(encoded);
+    seed_requests++;
+    if( ZYAN_FAILED( ZydisEncoderEncodeInstruction( req, encoded, &length ) ) )
+        return false;
+    if( seed_count == seed_capacity ) {
+        seed_capacity = seed_capacity ? 2*seed_capacity : 65536;
+        seeds = (seed_input*)realloc( seeds, seed_capacity * sizeof(seed_input) );
+    }
+    seed_input* seed = &seeds[seed_count++];
+    memset( seed, 0, sizeof(*seed) );
+    memcpy( seed->bytes, encoded, length );
+    seed->length = length;
+    seed->bits = bits;
+    return true;
+}
+
+
+// Operand forms tried for every mnemonic and mode: no operands,
+// any single operand, any pair, (reg, same reg class, any), any
+// working pair plus imm8, and the 4-operand vector forms
+// (v, v, v/m, imm8) and (v, v, v/m, v).
+
+int synthesize_seeds_for( ZydisMachineMode mode, int bits, ZydisMnemonic mnemonic ) {
+    int a, b, c;
+    int found = 0;
+    ZydisEncoderRequest req;
+    memset( &req, 0, sizeof(req) );
+    req.machine_mode = mode;
+    req.mnemonic = mnemonic;
+
+    int kinds[4];
+    found += try_seed_form( &req, bits, kinds, 0 );
+    for( a=0; a<SEED_OPERAND_KINDS; a++ ) {
+        kinds[0] = a;
+        found += try_seed_form( &req, bits, kinds, 1 );
+    }
+    for( a=0; a<SEED_OPERAND_KINDS; a++ ) {
+        for( b=0; b<SEED_OPERAND_KINDS; b++ ) {
+            kinds[0] = a;
+            kinds[1] = b;
+            if( try_seed_form( &req, bits, kinds, 2 ) ) {
+                found++;
+                kinds[2] = SEED_IMM8;
+                found += try_seed_form( &req, bits, kinds, 3 );
+            }
+        }
+    }
+    for( a=0; a<SEED_REGISTER_KINDS; a++ ) {
+        for( b=0; b<SEED_OPERAND_KINDS; b++ ) {
+            kinds[0] = a;
+            kinds[1] = a;
+            kinds[2] = b;
+            found += try_seed_form( &req, bits, kinds, 3 );
+        }
+    }
+    for( a=SEED_XMM; a<=SEED_ZMM; a++ ) {
+        for( c=0; c<=SEED_MEM512 - SEED_MEM8 + 1; c++ ) {
+            kinds[0] = a;
+            kinds[1] = a;
+            kinds[2] = c ? SEED_MEM8 + c - 1 : a;
+            kinds[3] = SEED_IMM8;
+            found += try_seed_form( &req, bits, kinds, 4 );
+            kinds[3] = a;
+            found += try_seed_form( &req, bits, kinds, 4 );
+        }
+    }
+    return found;
+}
+
+
+void synthesize_seeds(void) {
+    int m, k;
+    static const struct { ZydisMachineMode mode; int bits; } modes[3] = {
+        { ZYDIS_MACHINE_MODE_LEGACY_16, 16 },
+        { ZYDIS_MACHINE_MODE_LEGACY_32, 32 },
+        { ZYDIS_MACHINE_MODE_LONG_64,   64 }
+    };
+    double t_begin = wall_seconds();
+    for( k=0; k<3; k++ ) {
+        size_t first = seed_count;
+        uint64_t first_request = seed_requests;
+        double t_mode = wall_seconds();
+        int covered = 0;
+        for( m=1; m<=ZYDIS_MNEMONIC_MAX_VALUE; m++ )
+            covered += synthesize_seeds_for( modes[k].mode, modes[k].bits, (ZydisMnemonic)m ) > 0;
+        printf("%d-bit: %zu seeds covering %d of %d mnemonics (%llu encoder requests, %.2f s)\n",
+            modes[k].bits, seed_count - first, covered, (int)ZYDIS_MNEMONIC_MAX_VALUE,
+            (unsigned long long)(seed_requests - first_request), wall_seconds() - t_mode );
+    }
+    double elapsed = wall_seconds() - t_begin;
+    printf("Synthesized %zu seeds from %llu encoder requests in %.2f s (%.0f ns per request)\n",
+        seed_count, (unsigned long long)seed_requests, elapsed,
+        seed_requests ? elapsed * 1e9 / seed_requests : 0.0 );
+    fflush(stdout);
+}
+
+
+// Mutate a random seed into buf, returning the decoder to use.
+// 64-bit seeds go to any of the 64-bit decoders, including the
+// one without KNC, where EVEX seeds keep their meaning.
+
+int generate_seed_mutation( uint8_t buf[64] ) {
+    int i;
+    const seed_input* seed = &seeds[ (size_t)fuzz_rand() % seed_count ];
+    int decoder_index;
+    switch( seed->bits ) {
+        case 16: decoder_index = DECODER_X86_16; break;
+        case 32: decoder_index = DECODER_X86_32; break;
+        default: {
+            static const int decoders_64[3] = { DECODER_X86_64_INTEL, DECODER_X86_64_AMD, DECODER_X86_64 };
+            decoder_index = decoders_64[ fuzz_rand() % 3 ];
+            break;
+        }
+    }
+
+    // 0 to 3 inserted prefixes
+    int num_prefixes = fuzz_rand() & 3;
+    generate_prefix_bytes( buf, num_prefixes, seed->bits == 64 );
+    uint8_t* instr = buf + num_prefixes;
+    memcpy( instr, seed->bytes, seed->length );
+    for( i=num_prefixes + seed->length; i<64; i++ )
+        buf[i] = fuzz_rand() & 0xFF;
+
+    // 0 to 2 field mutations within the seed instruction
+    int mutations = fuzz_rand() % 3;
+    for( i=0; i<mutations; i++ ) {
+        int pos = fuzz_rand() % seed->length;
+        if( fuzz_rand() & 1 )
+            instr[pos] ^= 1 << (fuzz_rand() & 7);
+        else
+            instr[pos] = fuzz_rand() & 0xFF;
+    }
+    return decoder_index;
+}
+
+
+
+// ---------------------------------------------------
+//   Uninitialized-output detection. On sampled
+//   iterations the fuzz loop's own decode writes into
+//   outputs pre-filled with one poison pattern, and
+//   one more decode into outputs pre-filled with
+//   another. Every field the API defines on success
+//   must come out the same both times; a field that
+//   still differs was either never written or is
+//   nondeterministic. Fields are compared one by one:
+//   padding, union members other than the one the
+//   operand type selects, and raw fields of absent
+//   instruction parts are undefined and skipped.
+//
+//   A SIMD compare of both structs under a byte mask
+//   of the defined fields was measured as well, and
+//   was slower: the masks an instruction selects cover
+//   ~10 scattered 16-byte chunks, while the scalar
+//   field compares are inlined loads (~80 ns per
+//   sample against ~70 ns for the old unmasked SIMD
+//   compare of the whole structs).
+// ---------------------------------------------------
+
+#define POISON_A 0xAA
+#define POISON_B 0x55
+
+struct poison_outputs {
+    alignas(64) ZydisDecodedInstruction instr;
+    alignas(64) ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+};
+
+static __thread poison_outputs poisoned;
+__thread uint64_t poison_checks = 0;
+
+
+// Offset of the first byte in which a and b differ, or -1.
+
+static long first_difference( const void* a, const void* b, size_t n ) {
+    const uint8_t* pa = (const uint8_t*)a;
+    const uint8_t* pb = (const uint8_t*)b;
+    size_t i = 0;
+#if defined(__AVX2__)
+    for( ; i+32<=n; i+=32 ) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256( (const __m256i*)(pa+i) ),
+            _mm256_loadu_si256( (const __m256i*)(pb+i) ) );
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8( eq );
+        if( mask )
+            return i + __builtin_ctz( mask );
+    }
+#endif
+#if defined(__SSE2__)
+    for( ; i+16<=n; i+=16 ) {
+        __m128i eq = _mm_cmpeq_epi8(
+            _mm_loadu_si128( (const __m128i*)(pa+i) ),
+            _mm_loadu_si128( (const __m128i*)(pb+i) ) );
+        uint32_t mask = ~(uint32_t)_mm_movemask_epi8( eq ) & 0xFFFF;
+        if( mask )
+            return i + __builtin_ctz( mask );
+    }
+#endif
+    for( ; i<n; i++ ) {
+        if( pa[i] != pb[i] )
+            return i;
+    }
+    return -1;
+}
+
+
+static void poison_difference( const char* what, int index, const void* pa, const void* pb, size_t n ) {
+    long offset = first_difference( pa, pb, n );
+    uint8_t a = ((const uint8_t*)pa)[offset];
+    uint8_t b = ((const uint8_t*)pb)[offset];
+    char name[128];
+    if( index >= 0 )
+        snprintf( name, sizeof(name), "%s (i = %d)", what, index );
+    else
+        snprintf( name, sizeof(name), "%s", what );
+    invariant_failed( "%s byte %ld is %s (0x%02X with 0x%02X poison, 0x%02X with 0x%02X poison)",
+        name, offset,
+        a == POISON_A && b == POISON_B ? "left uninitialized" : "nondeterministic",
+        a, POISON_A, b, POISON_B );
+}
+
+
+// Compare one field of the two outputs a and b; index is the
+// i in the field's name, or -1. The fields are a few bytes
+// each, so the constant-size memcmp compiles to plain loads;
+// the section comment says why this is not a SIMD compare.
+#define POISON_FIELD( type, a, b, field, index ) \
+    do { \
+        if( memcmp( &(a)->field, &(b)->field, sizeof((a)->field) ) ) \
+            poison_difference( #type "." #field, index, &(a)->field, &(b)->field, sizeof((a)->field) ); \
+    } while(0)
+
+
+static void compare_poisoned_instruction( const ZydisDecodedInstruction* a, const ZydisDecodedInstruction* b ) {
+    int i;
+    POISON_FIELD( ZydisDecodedInstruction, a, b, machine_mode, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, mnemonic, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, length, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, encoding, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, opcode_map, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, opcode, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, stack_width, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, operand_width, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, address_width, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, operand_count, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, operand_count_visible, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, attributes, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, cpu_flags, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, fpu_flags, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, meta.category, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, meta.isa_set, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, meta.isa_ext, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, meta.branch_type, -1 );
+    POISON_FIELD( ZydisDecodedInstruction, a, b, meta.exception_class, -1 );
+
+    // AVX info only for the vector encodings, mask and friends
+    // only for EVEX and MVEX
+    switch( a->encoding ) {
+        case ZYDIS_INSTRUCTION_ENCODING_EVEX:
+        case ZYDIS_INSTRUCTION_ENCODING_MVEX:
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.mask.mode, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.mask.reg, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.broadcast.is_static, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.broadcast.mode, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.rounding.mode, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.swizzle.mode, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.conversion.mode, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.has_sae, -1 );
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.has_eviction_hint, -1 );
+            // fall through
+        case ZYDIS_INSTRUCTION_ENCODING_XOP:
+        case ZYDIS_INSTRUCTION_ENCODING_VEX:
+            POISON_FIELD( ZydisDecodedInstruction, a, b, avx.vector_length, -1 );
+            break;
+        default:
+            break;
+    }
+
+    POISON_FIELD( ZydisDecodedInstruction, a, b, raw.prefix_count, -1 );
+    if( a->raw.prefix_count > ZYDIS_MAX_INSTRUCTION_LENGTH )
+        invariant_failed( "raw.prefix_count is %d", a->raw.prefix_count );
+    for( i=0; i<a->raw.prefix_count; i++ ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.prefixes[i].type, i );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.prefixes[i].value, i );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_REX ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.rex.W, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.rex.R, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.rex.X, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.rex.B, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.rex.offset, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_XOP ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.R, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.X, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.B, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.m_mmmm, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.W, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.vvvv, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.L, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.pp, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.xop.offset, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_VEX ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.R, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.X, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.B, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.m_mmmm, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.W, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.vvvv, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.L, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.pp, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.offset, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.vex.size, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_EVEX ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.R, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.X, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.B, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.R2, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.mmm, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.W, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.vvvv, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.pp, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.z, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.L2, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.L, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.b, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.V2, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.aaa, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.evex.offset, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_MVEX ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.R, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.X, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.B, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.R2, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.mmmm, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.W, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.vvvv, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.pp, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.E, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.SSS, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.V2, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.kkk, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.mvex.offset, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_MODRM ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.modrm.mod, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.modrm.reg, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.modrm.rm, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.modrm.offset, -1 );
+    }
+    if( a->attributes & ZYDIS_ATTRIB_HAS_SIB ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.sib.scale, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.sib.index, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.sib.base, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.sib.offset, -1 );
+    }
+    POISON_FIELD( ZydisDecodedInstruction, a, b, raw.disp.size, -1 );
+    if( a->raw.disp.size ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.disp.value, -1 );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.disp.offset, -1 );
+    }
+    for( i=0; i<2; i++ ) {
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.imm[i].size, i );
+        if( !a->raw.imm[i].size )
+            continue;
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.imm[i].is_signed, i );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.imm[i].is_relative, i );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.imm[i].value.u, i );
+        POISON_FIELD( ZydisDecodedInstruction, a, b, raw.imm[i].offset, i );
+    }
+}
+
+
+static void compare_poisoned_operands( const ZydisDecodedOperand* a, const ZydisDecodedOperand* b, int count ) {
+    int i;
+    for( i=0; i<count; i++ ) {
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], id, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], visibility, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], actions, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], encoding, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], size, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], element_type, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], element_size, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], element_count, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], attributes, i );
+        POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], type, i );
+        switch( a[i].type ) {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], reg.value, i );
+                break;
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.type, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.segment, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.base, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.index, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.scale, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.disp.has_displacement, i );
+                if( a[i].mem.disp.has_displacement )
+                    POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], mem.disp.value, i );
+                break;
+            case ZYDIS_OPERAND_TYPE_POINTER:
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], ptr.segment, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], ptr.offset, i );
+                break;
+            case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], imm.is_signed, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], imm.is_relative, i );
+                POISON_FIELD( ZydisDecodedOperand[i], &a[i], &b[i], imm.value.u, i );
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+// Before the fuzz loop's decode of a sampled input.
+
+static inline void poison_decode_outputs( ZydisDecodedInstruction* instr, ZydisDecodedOperand* operands ) {
+    memset( instr, POISON_A, sizeof(*instr) );
+    memset( operands, POISON_A, ZYDIS_MAX_OPERAND_COUNT_VISIBLE * sizeof(ZydisDecodedOperand) );
+}
+
+
+// After it: decode once more into POISON_B outputs and compare.
+
+void check_poison_decode( const ZydisDecoder* decoder, const uint8_t* buf, ZyanStatus status,
+                          const ZydisDecodedInstruction* instr, const ZydisDecodedOperand* operands ) {
+    memset( &poisoned, POISON_B, sizeof(poisoned) );
+    ZyanStatus again = ZydisDecoderDecodeFull(
+        decoder, buf, 64, &poisoned.instr, poisoned.operands,
+        ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+    poison_checks++;
+    if( status != again )
+        invariant_failed( "decoding the same input twice gave status 0x%08X and 0x%08X",
+            status, again );
+    if( ZYAN_FAILED(status) )
+        return;     // outputs are undefined on failure
+
+    compare_poisoned_instruction( instr, &poisoned.instr );
+    int count = instr->operand_count_visible;
+    if( count > ZYDIS_MAX_OPERAND_COUNT_VISIBLE )
+        invariant_failed( "operand_count_visible is %d", count );
+    compare_poisoned_operands( operands, poisoned.operands, count );
+}
+
+
+
+// ---------------------------------------------------
+//   Operand-array overflow detection (--operand-guard).
+//   The fuzz loop always passes a full array and the
+//   maximum operand_count, so a decoder writing past a
+//   smaller count would go unnoticed. Sampled inputs
+//   are decoded once more with a random count from 0
+//   to the maximum of a random operand mode, into an
+//   array that ends flush against a PROT_NONE page:
+//   a write past the declared count faults at once,
+//   and the SIGSEGV handler prints the count. Whatever
+//   fits must match a decode with the full array.
+// ---------------------------------------------------
+
+struct operand_guard_area {
+    uint8_t* guard;         // first byte of the PROT_NONE page
+    ZydisDecodedInstruction instr[2];
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+};
+
+static __thread operand_guard_area* operand_guard = NULL;
+__thread int operand_guard_countdown = 0;
+__thread uint64_t operand_guard_checks = 0;
+__thread uint64_t operand_guard_truncated = 0;
+
+
+static operand_guard_area* operand_guard_thread_area(void) {
+    if( operand_guard )
+        return operand_guard;
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    size_t data = (ZYDIS_MAX_OPERAND_COUNT * sizeof(ZydisDecodedOperand) + page - 1) / page * page;
+    void* p = mmap( NULL, data + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED || mprotect( (uint8_t*)p + data, page, PROT_NONE ) ) {
+        printf("Cannot map the operand guard page: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+    operand_guard = (operand_guard_area*)calloc( 1, sizeof(operand_guard_area) );
+    operand_guard->guard = (uint8_t*)p + data;
+    return operand_guard;
+}
+
+
+void check_operand_guard( const ZydisDecoder* decoder, const uint8_t* buf ) {
+    operand_guard_area* area = operand_guard_thread_area();
+    uint64_t r = stage_rand();
+    bool visible_only = r & 1;
+    int max_count = visible_only ? ZYDIS_MAX_OPERAND_COUNT_VISIBLE : ZYDIS_MAX_OPERAND_COUNT;
+    int count = (int)((r >> 1) % (max_count + 1));
+    ZydisDecodingFlags flags = visible_only ? ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY : 0;
+
+    memset( area->instr, 0, sizeof(area->instr) );
+    memset( area->operands, 0, sizeof(area->operands) );
+    ZyanStatus full = ZydisDecoderDecodeFull(
+        decoder, buf, 64, &area->instr[0], area->operands, max_count, flags );
+
+    ZydisDecodedOperand* guarded = (ZydisDecodedOperand*)(area->guard - count * sizeof(ZydisDecodedOperand));
+    memset( guarded, 0, count * sizeof(ZydisDecodedOperand) );
+    operand_guard_count = count;
+    ZyanStatus status = ZydisDecoderDecodeFull(
+        decoder, buf, 64, &area->instr[1], guarded, count, flags );
+    operand_guard_count = -1;
+    operand_guard_checks++;
+
+    if( ZYAN_FAILED(full) ) {
+        if( status != full )
+            invariant_failed( "operand_count %d changed decode status 0x%08X to 0x%08X",
+                count, full, status );
+        return;
+    }
+    int needed = visible_only ? area->instr[0].operand_count_visible : area->instr[0].operand_count;
+    if( needed > max_count )
+        invariant_failed( "%d operands decoded into an array of %d", needed, max_count );
+    if( ZYAN_FAILED(status) ) {
+        if( count >= needed )
+            invariant_failed( "operand_count %d (%d needed) failed with status 0x%08X",
+                count, needed, status );
+        operand_guard_truncated++;
+        return;     // too small an array may be refused
+    }
+    if( count < needed )
+        operand_guard_truncated++;
+
+    long offset = first_difference( &area->instr[0], &area->instr[1], sizeof(ZydisDecodedInstruction) );
+    if( offset >= 0 )
+        invariant_failed( "operand_count %d changed ZydisDecodedInstruction byte %ld", count, offset );
+    int compared = count < needed ? count : needed;
+    offset = first_difference( area->operands, guarded, compared * sizeof(ZydisDecodedOperand) );
+    if( offset >= 0 )
+        invariant_failed( "operand_count %d changed operand %ld byte %ld", count,
+            offset / (long)sizeof(ZydisDecodedOperand), offset % (long)sizeof(ZydisDecodedOperand) );
+}
+
+
+
+// ---------------------------------------------------
+//   objdump oracle (--objdump[=N]). Every Nth input is
+//   re-decoded with the non-KNC decoder of its mode,
+//   which matches what binutils knows, and successful
+//   decodes are collected into one batch per mode.
+//   Each input occupies a 32-byte stride, padded with
+//   NOPs; whatever objdump makes of an instruction, it
+//   is back in step at the next stride, so one length
+//   disagreement does not spoil the rest of the batch.
+//   A full batch is written to a temporary file and
+//   disassembled by a single objdump run, and length
+//   and mnemonic are compared for each stride start.
+//   Prefix words and condition-code spellings are
+//   normalized to Zydis conventions first.
+// ---------------------------------------------------
+
+#define OBJDUMP_BATCH 4096
+#define OBJDUMP_STRIDE 32
+#define OBJDUMP_REPORTS 20
+#define OBJDUMP_PAIRS 256
+
+struct objdump_batch {
+    int decoder_index;
+    const char* machine;            // objdump -m argument
+    int count;
+    uint8_t lengths[OBJDUMP_BATCH];
+    uint16_t mnemonics[OBJDUMP_BATCH];
+    bool seen[OBJDUMP_BATCH];
+    uint8_t blob[OBJDUMP_BATCH * OBJDUMP_STRIDE];
+};
+
+struct objdump_pair {
+    char zydis[32];
+    char objdump[32];
+    uint64_t count;
+    uint8_t bytes[16];
+    int length;
+    int bits;
+};
+
+struct objdump_state {
+    int interval;
+    int countdown;
+    bool disabled;
+    objdump_batch batches[3];       // 16, 32 and 64 bit
+    uint64_t sampled;
+    uint64_t compared;
+    uint64_t length_mismatches;
+    uint64_t mnemonic_mismatches;
+    uint64_t rejected;              // objdump says (bad)
+    uint64_t missing;               // no objdump line at the stride start
+    double seconds;                 // spent in objdump runs
+    int length_reports;
+    int pair_count;
+    objdump_pair pairs[OBJDUMP_PAIRS];
+};
+
+objdump_state* objdump_oracle = NULL;
+
+
+void init_objdump_oracle( int interval ) {
+    static const int decoder_indices[3] = { DECODER_X86_16, DECODER_X86_32, DECODER_X86_64 };
+    static const char* machines[3] = { "i8086", "i386", "i386:x86-64" };
+    int i;
+    objdump_oracle = (objdump_state*)calloc( 1, sizeof(objdump_state) );
+    objdump_oracle->interval = interval;
+    objdump_oracle->countdown = interval;
+    for( i=0; i<3; i++ ) {
+        objdump_oracle->batches[i].decoder_index = decoder_indices[i];
+        objdump_oracle->batches[i].machine = machines[i];
+    }
+}
+
+
+// Map an objdump mnemonic to the Zydis spelling: condition
+// codes (je -> jz, cmovae -> cmovnb, ...) and a few aliases.
+
+void normalize_objdump_mnemonic( const char* in, char* out, size_t size ) {
+    static const char* const cc_aliases[][2] = {
+        { "e", "z" },   { "ne", "nz" }, { "c", "b" },    { "nae", "b" },
+        { "nc", "nb" }, { "ae", "nb" }, { "na", "be" },  { "a", "nbe" },
+        { "pe", "p" },  { "po", "np" }, { "nge", "l" },  { "ge", "nl" },
+        { "ng", "le" }, { "g", "nle" }
+    };
+    static const char* const cc_families[] = { "j", "set", "cmov" };
+    size_t f, k;
+    snprintf( out, size, "%s", in );
+    if( !strcmp( in, "movabs" ) ) {
+        snprintf( out, size, "mov" );
+        return;
+    }
+    for( f=0; f<sizeof(cc_families)/sizeof(cc_families[0]); f++ ) {
+        size_t n = strlen( cc_families[f] );
+        if( strncmp( in, cc_families[f], n ) )
+            continue;
+        for( k=0; k<sizeof(cc_aliases)/sizeof(cc_aliases[0]); k++ ) {
+            if( !strcmp( in + n, cc_aliases[k][0] ) ) {
+                snprintf( out, size, "%s%s", cc_families[f], cc_aliases[k][1] );
+                return;
+            }
+        }
+    }
+}
+
+
+// First word of the disassembly that is not a prefix.
+
+void objdump_mnemonic( const char* text, char* out, size_t size ) {
+    static const char* const prefix_words[] = {
+        "lock", "rep", "repz", "repnz", "repe", "repne", "bnd", "notrack",
+        "data16", "data32", "addr16", "addr32", "xacquire", "xrelease",
+        "cs", "ds", "es", "fs", "gs", "ss", "{vex}", "{vex3}", "{evex}"
+    };
+    char word[64];
+    out[0] = 0;
+    for(;;) {
+        while( *text == ' ' || *text == '\t' )
+            text++;
+        size_t n = 0;
+        while( text[n] && text[n] != ' ' && text[n] != '\t' && text[n] != '\n' )
+            n++;
+        if( !n )
+            return;
+        if( n >= sizeof(word) )
+            n = sizeof(word) - 1;
+        memcpy( word, text, n );
+        word[n] = 0;
+        text += n;
+        bool prefix = !strncmp( word, "rex", 3 );
+        size_t k;
+        for( k=0; k<sizeof(prefix_words)/sizeof(prefix_words[0]) && !prefix; k++ )
+            prefix = !strcmp( word, prefix_words[k] );
+        if( !prefix ) {
+            normalize_objdump_mnemonic( word, out, size );
+            return;
+        }
+    }
+}
+
+
+void objdump_count_pair( const char* zydis, const char* objdump, const uint8_t* bytes, int length, int bits ) {
+    int i;
+    for( i=0; i<objdump_oracle->pair_count; i++ ) {
+        objdump_pair* pair = &objdump_oracle->pairs[i];
+        if( !strcmp( pair->zydis, zydis ) && !strcmp( pair->objdump, objdump ) ) {
+            pair->count++;
+            return;
+        }
+    }
+    if( objdump_oracle->pair_count == OBJDUMP_PAIRS )
+        return;
+    objdump_pair* pair = &objdump_oracle->pairs[objdump_oracle->pair_count++];
+    snprintf( pair->zydis, sizeof(pair->zydis), "%s", zydis );
+    snprintf( pair->objdump, sizeof(pair->objdump), "%s", objdump );
+    pair->count = 1;
+    memcpy( pair->bytes, bytes, length );
+    pair->length = length;
+    pair->bits = bits;
+}
+
+
+void objdump_compare( objdump_batch* batch, int k, int length, const char* text ) {
+    const uint8_t* bytes = batch->blob + k * OBJDUMP_STRIDE;
+    const char* zydis = ZydisMnemonicGetString( (ZydisMnemonic)batch->mnemonics[k] );
+    int bits = decoder_bits[batch->decoder_index];
+    int i;
+    char mnemonic[32];
+    objdump_mnemonic( text, mnemonic, sizeof(mnemonic) );
+    batch->seen[k] = true;
+    objdump_oracle->compared++;
+    if( !strcmp( mnemonic, "(bad)" ) ) {
+        objdump_oracle->rejected++;
+        objdump_count_pair( zydis ? zydis : "?", "(bad)", bytes, batch->lengths[k], bits );
+    } else if( length != batch->lengths[k] ) {
+        objdump_oracle->length_mismatches++;
+        if( objdump_oracle->length_reports++ < OBJDUMP_REPORTS ) {
+            printf("\nobjdump length differs in %d-bit mode:", bits );
+            for( i=0; i<batch->lengths[k] || i<length; i++ )
+                printf(" %02X", bytes[i] );
+            printf("\n  Zydis   %2d  %s\n  objdump %2d  %s\n", batch->lengths[k], zydis, length, text );
+        }
+    } else if( !zydis || strcmp( zydis, mnemonic ) ) {
+        objdump_oracle->mnemonic_mismatches++;
+        objdump_count_pair( zydis ? zydis : "?", mnemonic, bytes, length, bits );
+    }
+}
+
+
+void objdump_run_batch( objdump_batch* batch ) {
+    int k;
+    if( !batch->count || objdump_oracle->disabled )
+        return;
+    uint64_t trace_batch = trace_begin();
+    double t_begin = wall_seconds();
+    const char* tmpdir = getenv( "TMPDIR" );
+    char path[PATH_MAX];
+    snprintf( path, sizeof(path), "%s/zydis-objdump-XXXXXX", tmpdir ? tmpdir : "/tmp" );
+    int fd = mkstemp( path );
+    size_t bytes = (size_t)batch->count * OBJDUMP_STRIDE;
+    if( fd < 0 || write( fd, batch->blob, bytes ) != (ssize_t)bytes ) {
+        printf("Cannot write objdump batch %s: %s; objdump oracle disabled\n", path, strerror(errno) );
+        objdump_oracle->disabled = true;
+        if( fd >= 0 ) {
+            close( fd );
+            unlink( path );
+        }
+        return;
+    }
+    close( fd );
+
+    const char* objdump = getenv( "OBJDUMP" );
+    char command[PATH_MAX + 256];
+    snprintf( command, sizeof(command), "%s -D -b binary -m %s -M intel --insn-width=16 %s 2>/dev/null",
+        objdump ? objdump : "objdump", batch->machine, path );
+    FILE* out = popen( command, "r" );
+    int lines = 0;
+    memset( batch->seen, 0, batch->count * sizeof(bool) );
+    if( out ) {
+        // "   40:\t48 89 e5             \tmov    rbp,rsp"
+        char line[512];
+        while( fgets( line, sizeof(line), out ) ) {
+            char* end;
+            unsigned long address = strtoul( line, &end, 16 );
+            if( end == line || *end != ':' || end[1] != '\t' )
+                continue;
+            lines++;
+            if( address % OBJDUMP_STRIDE || address / OBJDUMP_STRIDE >= (unsigned long)batch->count )
+                continue;
+            char* p = end + 2;
+            int length = 0;
+            while( *p && *p != '\t' ) {
+                if( p[0] != ' ' && p[1] && p[1] != ' ' && p[1] != '\t' ) {
+                    length++;
+                    p += 2;
+                } else {
+                    p++;
+                }
+            }
+            if( *p == '\t' )
+                p++;
+            p[strcspn( p, "\n" )] = 0;
+            objdump_compare( batch, (int)(address / OBJDUMP_STRIDE), length, p );
+        }
+        pclose( out );
+    }
+    unlink( path );
+    if( !lines ) {
+        printf("\n%s produced no disassembly; objdump oracle disabled\n", objdump ? objdump : "objdump" );
+        objdump_oracle->disabled = true;
+    }
+    for( k=0; k<batch->count; k++ )
+        objdump_oracle->missing += !batch->seen[k];
+    trace_end( "objdump", trace_batch, batch->count );
+    batch->count = 0;
+    objdump_oracle->seconds += wall_seconds() - t_begin;
+}
+
+
+void objdump_sample( int decoder_index, const uint8_t* buf ) {
+    int bits = decoder_bits[decoder_index];
+    objdump_batch* batch = &objdump_oracle->batches[bits == 16 ? 0 : bits == 32 ? 1 : 2];
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    if( ZYAN_FAILED( wrapped_ZydisDecoderDecodeFull( &decoders[batch->decoder_index], buf, 64,
+            &instr, operands, ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY ) ) )
+        return;
+    uint8_t* slot = batch->blob + batch->count * OBJDUMP_STRIDE;
+    memcpy( slot, buf, instr.length );
+    memset( slot + instr.length, 0x90, OBJDUMP_STRIDE - instr.length );
+    batch->lengths[batch->count] = instr.length;
+    batch->mnemonics[batch->count] = (uint16_t)instr.mnemonic;
+    objdump_oracle->sampled++;
+    if( ++batch->count == OBJDUMP_BATCH )
+        objdump_run_batch( batch );
+}
+
+
+void objdump_report( double elapsed ) {
+    int i, r;
+    for( i=0; i<3; i++ )
+        objdump_run_batch( &objdump_oracle->batches[i] );
+    uint64_t compared = objdump_oracle->compared;
+    printf("objdump oracle: %llu sampled, %llu compared, %llu length and %llu mnemonic differences, "
+           "%llu rejected by objdump, %llu unmatched (%.1f%% of run time in objdump)\n",
+        (unsigned long long)objdump_oracle->sampled, (unsigned long long)compared,
+        (unsigned long long)objdump_oracle->length_mismatches,
+        (unsigned long long)objdump_oracle->mnemonic_mismatches,
+        (unsigned long long)objdump_oracle->rejected, (unsigned long long)objdump_oracle->missing,
+        elapsed > 0 ? 100.0 * objdump_oracle->seconds / elapsed : 0.0 );
+    // most frequent mnemonic disagreements, with one example each
+    for( r=0; r<OBJDUMP_REPORTS; r++ ) {
+        objdump_pair* best = NULL;
+        for( i=0; i<objdump_oracle->pair_count; i++ ) {
+            objdump_pair* pair = &objdump_oracle->pairs[i];
+            if( pair->count && (!best || pair->count > best->count) )
+                best = pair;
+        }
+        if( !best )
+            break;
+        if( !r )
+            printf("Most frequent mnemonic differences (Zydis / objdump):\n");
+        printf("  %8llu  %-20s %-20s %d-bit", (unsigned long long)best->count, best->zydis, best->objdump, best->bits );
+        for( i=0; i<best->length; i++ )
+            printf(" %02X", best->bytes[i] );
+        printf("\n");
+        best->count = 0;
+    }
+}
+
+
+
+// ---------------------------------------------------
+//   Hardware length oracle (--hw-oracle[=N]). Every
+//   Nth 64-bit input that the non-KNC decoder accepts
+//   is executed on the host CPU, sandsifter style: the
+//   first k bytes are placed at the end of an
+//   executable page followed by an inaccessible one.
+//   If the CPU needs more than k bytes, the fetch
+//   faults at the second page; otherwise whatever the
+//   instruction does happens first. Probing k = L and
+//   k = L-1 for the Zydis length L confirms it with two
+//   runs; only disagreements are searched byte by byte.
+//
+//   Candidates run single-stepped (TF) with all general
+//   registers zeroed, from a page far away from
+//   anything else, so that memory operands fault rather
+//   than hit the executor. Classes that would escape
+//   that sandbox are skipped: system calls, interrupts,
+//   far branches and IRET, segment register loads,
+//   FS/GS-relative and VSIB operands, absolute 64-bit
+//   addresses and WRFSBASE/WRGSBASE.
+//
+//   Batches run in a forked executor process, which
+//   the parent restarts past a candidate that kills it.
+// ---------------------------------------------------
+
+#define HW_BATCH 4096
+#define HW_REPORTS 20
+#define HW_EXECUTOR_SECONDS 30
+#define HW_SETUP_FAILED 3
+
+enum hw_outcome {
+    HW_PENDING,
+    HW_AGREE,
+    HW_LONGER,          // the CPU fetched beyond the Zydis length
+    HW_SHORTER,         // the CPU was done before the Zydis length
+    HW_UNDEFINED,       // #UD on this CPU
+    HW_KILLED           // took the executor down
+};
+
+struct hw_candidate {
+    uint8_t bytes[16];
+    uint8_t zydis_length;
+    uint8_t hw_length;      // 0 = not determined
+    uint8_t outcome;        // hw_outcome
+    uint8_t signo;          // signal at the Zydis length
+    uint16_t mnemonic;
+};
+
+// Shared with the executor process.
+struct hw_shared {
+    int count;
+    volatile int progress;  // candidates finished by the executor
+    hw_candidate candidates[HW_BATCH];
+};
+
+struct hw_state {
+    int interval;
+    int countdown;
+    bool disabled;
+    ZydisDecoder decoder;   // non-KNC, branch behavior of the host vendor
+    hw_shared* shared;
+    uint64_t sampled;
+    uint64_t skipped;
+    uint64_t outcomes[HW_KILLED + 1];
+    uint64_t forks;
+    double seconds;
+    int reports;
+};
+
+hw_state* hw_oracle = NULL;
+
+
+#ifdef HW_ORACLE_SUPPORTED
+
+// Executor-side state; only used in the forked process.
+
+sigjmp_buf hw_jump;
+volatile sig_atomic_t hw_armed = 0;     // 1: entering, 2: candidate running
+uint8_t* hw_page;                       // executable; the next page is not
+size_t hw_page_size;
+uintptr_t hw_entry;
+int hw_signo;
+uintptr_t hw_fault_address;
+uint64_t hw_fault_error;
+
+// The code page must land exactly here, far from the executor's
+// own memory; older kernels ignore MAP_FIXED_NOREPLACE, so the
+// address is checked as well.
+#define HW_CODE_ADDRESS 0x100000000000ull
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#define HW_PF_INSTRUCTION_FETCH 0x10
+
+
+void hw_signal_handler( int signo, siginfo_t* info, void* context ) {
+    static const int gprs[] = {
+        REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+    };
+    greg_t* regs = ((ucontext_t*)context)->uc_mcontext.gregs;
+    size_t i;
+    if( hw_armed == 1 && signo == SIGTRAP && (uintptr_t)regs[REG_RIP] == hw_entry ) {
+        // The trap after the entering jump: the candidate has
+        // not run yet. Let it run from a clean register file.
+        for( i=0; i<sizeof(gprs)/sizeof(gprs[0]); i++ )
+            regs[gprs[i]] = 0;
+        regs[REG_EFL] = 0x302;      // TF, IF and the reserved bit
+        hw_armed = 2;
+        return;
+    }
+    if( !hw_armed )
+        _exit( 128 + signo );       // the executor itself faulted
+    hw_armed = 0;
+    hw_signo = signo;
+    hw_fault_address = (uintptr_t)info->si_addr;
+    hw_fault_error = (uint64_t)regs[REG_ERR];
+    siglongjmp( hw_jump, 1 );
+}
+
+
+// Set TF and jump. The trap fires once the jump is done.
+
+__attribute__((noinline)) void hw_enter( uint8_t* code ) {
+    __asm__ volatile(
+        "pushfq\n\t"
+        "orq $0x100, (%%rsp)\n\t"
+        "popfq\n\t"
+        "jmp *%0\n\t"
+        : : "r"(code) : "memory", "cc" );
+    __builtin_unreachable();
+}
+
+
+// Run the first k bytes, ending at the page boundary.
+// Returns true if the CPU wanted more of them.
+
+bool hw_probe( const uint8_t* bytes, int k, int* signo ) {
+    uint8_t* code = hw_page + hw_page_size - k;
+    memcpy( code, bytes, k );
+    hw_entry = (uintptr_t)code;
+    if( !sigsetjmp( hw_jump, 1 ) ) {
+        hw_armed = 1;
+        hw_enter( code );
+    }
+    *signo = hw_signo;
+    return hw_signo == SIGSEGV
+        && hw_fault_address == (uintptr_t)(hw_page + hw_page_size)
+        && (hw_fault_error & HW_PF_INSTRUCTION_FETCH);
+}
+
+
+void hw_classify( hw_candidate* c ) {
+    int length = c->zydis_length;
+    int signo, ignored, k;
+    if( hw_probe( c->bytes, length, &signo ) ) {
+        for( k=length+1; k<=15 && hw_probe( c->bytes, k, &ignored ); k++ );
+        c->hw_length = k <= 15 ? k : 0;
+        c->outcome = HW_LONGER;
+    } else if( signo == SIGILL ) {
+        c->hw_length = 0;
+        c->outcome = HW_UNDEFINED;
+    } else if( length > 1 && !hw_probe( c->bytes, length - 1, &ignored ) ) {
+        for( k=1; k<length-1 && hw_probe( c->bytes, k, &ignored ); k++ );
+        c->hw_length = k;
+        c->outcome = HW_SHORTER;
+    } else {
+        c->hw_length = length;
+        c->outcome = HW_AGREE;
+    }
+    c->signo = signo;
+}
+
+
+void hw_executor( hw_shared* shared, int start ) {
+    static const int signals[] = { SIGTRAP, SIGSEGV, SIGILL, SIGBUS, SIGFPE };
+    size_t i;
+    int n;
+    // rsp is zero while a candidate runs
+    stack_t ss;
+    ss.ss_sp = malloc( 1 << 16 );
+    ss.ss_size = 1 << 16;
+    ss.ss_flags = 0;
+    struct sigaction sa;
+    memset( &sa, 0, sizeof(sa) );
+    sigemptyset( &sa.sa_mask );
+    sa.sa_sigaction = hw_signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    if( !ss.ss_sp || sigaltstack( &ss, NULL ) )
+        _exit( HW_SETUP_FAILED );
+    for( i=0; i<sizeof(signals)/sizeof(signals[0]); i++ )
+        sigaction( signals[i], &sa, NULL );
+
+    hw_page_size = (size_t)sysconf( _SC_PAGESIZE );
+    void* p = mmap( (void*)HW_CODE_ADDRESS, 2 * hw_page_size, PROT_READ|PROT_WRITE|PROT_EXEC,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0 );
+    if( p == MAP_FAILED || p != (void*)HW_CODE_ADDRESS || mprotect( (uint8_t*)p + hw_page_size, hw_page_size, PROT_NONE ) )
+        _exit( HW_SETUP_FAILED );
+    hw_page = (uint8_t*)p;
+
+    alarm( HW_EXECUTOR_SECONDS );
+    for( n=start; n<shared->count; n++ ) {
+        hw_classify( &shared->candidates[n] );
+        shared->progress = n + 1;
+    }
+    _exit( 0 );
+}
+
+
+void init_hw_oracle( int interval ) {
+    unsigned int eax, ebx, ecx, edx;
+    bool amd = false;
+    if( __get_cpuid( 0, &eax, &ebx, &ecx, &edx ) )
+        amd = (ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163)     // AuthenticAMD
+           || (ebx == 0x6f677948 && edx == 0x6e65476e && ecx == 0x656e6975);   // HygonGenuine
+    hw_shared* shared = (hw_shared*)mmap( NULL, sizeof(hw_shared), PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+    if( shared == MAP_FAILED ) {
+        printf("Cannot map the hardware oracle batch: %s\n", strerror(errno) );
+        return;
+    }
+    hw_oracle = (hw_state*)calloc( 1, sizeof(hw_state) );
+    hw_oracle->interval = interval;
+    hw_oracle->countdown = interval;
+    hw_oracle->shared = shared;
+    ZydisDecoderInit( &hw_oracle->decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64 );
+    if( amd )
+        ZydisDecoderEnableMode( &hw_oracle->decoder, ZYDIS_DECODER_MODE_AMD_BRANCHES, true );
+}
+
+
+// Instructions that could leave the sandbox described above.
+
+bool hw_denied( const ZydisDecodedInstruction* instr, const ZydisDecodedOperand* operands ) {
+    int i;
+    switch( instr->meta.category ) {
+        case ZYDIS_CATEGORY_SYSCALL:
+        case ZYDIS_CATEGORY_SYSRET:
+        case ZYDIS_CATEGORY_INTERRUPT:
+        case ZYDIS_CATEGORY_SEGOP:
+            return true;
+        default:
+            break;
+    }
+    switch( instr->mnemonic ) {
+        case ZYDIS_MNEMONIC_SYSCALL:
+        case ZYDIS_MNEMONIC_SYSENTER:
+        case ZYDIS_MNEMONIC_SYSEXIT:
+        case ZYDIS_MNEMONIC_SYSRET:
+        case ZYDIS_MNEMONIC_INT:
+        case ZYDIS_MNEMONIC_IRET:
+        case ZYDIS_MNEMONIC_IRETD:
+        case ZYDIS_MNEMONIC_IRETQ:
+        case ZYDIS_MNEMONIC_WRFSBASE:
+        case ZYDIS_MNEMONIC_WRGSBASE:
+            return true;
+        default:
+            break;
+    }
+    if( instr->meta.branch_type == ZYDIS_BRANCH_TYPE_FAR )
+        return true;
+    for( i=0; i<instr->operand_count; i++ ) {
+        const ZydisDecodedOperand* op = &operands[i];
+        if( op->type == ZYDIS_OPERAND_TYPE_REGISTER ) {
+            if( ZydisRegisterGetClass( op->reg.value ) == ZYDIS_REGCLASS_SEGMENT
+                    && (op->actions & ZYDIS_OPERAND_ACTION_MASK_WRITE) )
+                return true;
+        } else if( op->type == ZYDIS_OPERAND_TYPE_MEMORY ) {
+            if( op->mem.segment == ZYDIS_REGISTER_FS || op->mem.segment == ZYDIS_REGISTER_GS )
+                return true;
+            if( op->mem.type == ZYDIS_MEMOP_TYPE_VSIB )
+                return true;
+            if( op->mem.base == ZYDIS_REGISTER_NONE && op->mem.index == ZYDIS_REGISTER_NONE
+                    && (op->mem.disp.value < INT32_MIN || op->mem.disp.value > INT32_MAX) )
+                return true;
+        }
+    }
+    return false;
+}
+
+
+void hw_report_candidate( const hw_candidate* c, const char* what ) {
+    int i;
+    if( hw_oracle->reports++ >= HW_REPORTS )
+        return;
+    printf("\nHardware oracle: %s\n  ", what );
+    for( i=0; i<15; i++ )
+        printf(" %02X", c->bytes[i] );
+    printf("\n  Zydis %2d  %s\n", c->zydis_length, ZydisMnemonicGetString( (ZydisMnemonic)c->mnemonic ) );
+    if( c->hw_length )
+        printf("  CPU   %2d\n", c->hw_length );
+}
+
+
+void hw_run_batch(void) {
+    hw_shared* shared = hw_oracle->shared;
+    int start = 0, n;
+    if( !shared->count || hw_oracle->disabled )
+        return;
+    uint64_t trace_batch = trace_begin();
+    double t_begin = wall_seconds();
+    while( start < shared->count ) {
+        shared->progress = start;
+        fflush(stdout);
+        pid_t pid = fork();
+        if( pid == 0 )
+            hw_executor( shared, start );
+        if( pid < 0 ) {
+            printf("\nCannot fork the hardware oracle executor: %s; oracle disabled\n", strerror(errno) );
+            hw_oracle->disabled = true;
+            break;
+        }
+        hw_oracle->forks++;
+        int wstatus;
+        while( waitpid( pid, &wstatus, 0 ) < 0 && errno == EINTR );
+        if( WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == HW_SETUP_FAILED && shared->progress == start ) {
+            printf("\nThe hardware oracle executor cannot set up its pages; oracle disabled\n");
+            hw_oracle->disabled = true;
+            break;
+        }
+        if( shared->progress >= shared->count )
+            break;
+        // the candidate at progress took the executor down
+        hw_candidate* c = &shared->candidates[shared->progress];
+        c->outcome = HW_KILLED;
+        c->hw_length = 0;
+        c->signo = WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : WEXITSTATUS(wstatus) > 128 ? WEXITSTATUS(wstatus) - 128 : 0;
+        start = shared->progress + 1;
+    }
+    for( n=0; n<shared->count && !hw_oracle->disabled; n++ ) {
+        hw_candidate* c = &shared->candidates[n];
+        hw_oracle->outcomes[c->outcome]++;
+        char what[64];
+        switch( c->outcome ) {
+            case HW_LONGER:
+                hw_report_candidate( c, "the CPU reads more bytes" );
+                break;
+            case HW_SHORTER:
+                hw_report_candidate( c, "the CPU reads fewer bytes" );
+                break;
+            case HW_KILLED:
+                snprintf( what, sizeof(what), "the executor died (signal %d)", c->signo );
+                hw_report_candidate( c, what );
+                break;
+            default:
+                break;
+        }
+    }
+    trace_end( "hw oracle", trace_batch, shared->count );
+    shared->count = 0;
+    hw_oracle->seconds += wall_seconds() - t_begin;
+}
+
+
+void hw_sample( int decoder_index, const uint8_t* buf ) {
+    if( decoder_bits[decoder_index] != 64 )
+        return;
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+    if( ZYAN_FAILED( wrapped_ZydisDecoderDecodeFull( &hw_oracle->decoder, buf, 64,
+            &instr, operands, ZYDIS_MAX_OPERAND_COUNT, 0 ) ) )
+        return;
+    if( hw_denied( &instr, operands ) ) {
+        hw_oracle->skipped++;
+        return;
+    }
+    hw_shared* shared = hw_oracle->shared;
+    hw_candidate* c = &shared->candidates[shared->count];
+    memcpy( c->bytes, buf, 15 );
+    c->bytes[15] = 0;
+    c->zydis_length = instr.length;
+    c->mnemonic = (uint16_t)instr.mnemonic;
+    c->outcome = HW_PENDING;
+    hw_oracle->sampled++;
+    if( ++shared->count == HW_BATCH )
+        hw_run_batch();
+}
+
+#else
+
+void init_hw_oracle( int interval ) {
+    (void)interval;
+    printf("--hw-oracle needs x86-64 Linux; oracle disabled\n");
+}
+
+void hw_run_batch(void) {}
+void hw_sample( int decoder_index, const uint8_t* buf ) { (void)decoder_index; (void)buf; }
+
+#endif
+
+
+void hw_oracle_report( double elapsed ) {
+    hw_run_batch();
+    const uint64_t* o = hw_oracle->outcomes;
+    printf("Hardware oracle: %llu executed, %llu skipped as unsafe; %llu agree, %llu longer and "
+           "%llu shorter on the CPU, %llu #UD on this CPU, %llu killed the executor "
+           "(%llu forks, %.1f%% of run time)\n",
+        (unsigned long long)hw_oracle->sampled, (unsigned long long)hw_oracle->skipped,
+        (unsigned long long)o[HW_AGREE], (unsigned long long)o[HW_LONGER],
+        (unsigned long long)o[HW_SHORTER], (unsigned long long)o[HW_UNDEFINED],
+        (unsigned long long)o[HW_KILLED], (unsigned long long)hw_oracle->forks,
+        elapsed > 0 ? 100.0 * hw_oracle->seconds / elapsed : 0.0 );
+}
+
+
+
+// ---------------------------------------------------
+//   Stack-depth profiling (--stack-depth[=N]). Every
+//   Nth input is decoded, and on success formatted,
+//   once more on a dedicated 256 KiB stack that is
+//   painted with a fill pattern and entered through
+//   swapcontext(). The lowest overwritten word gives
+//   the high-water mark of the call; only that part is
+//   repainted afterwards. The depth of an empty call
+//   is measured at startup and subtracted, so that the
+//   numbers are what Zydis itself needs. The deepest
+//   input of every escape class is kept per stage. A
+//   PROT_NONE page below the stack turns an overflow
+//   into a SIGSEGV, handled on an alternate stack.
+// ---------------------------------------------------
+
+enum escape_class {
+    ESCAPE_NONE, ESCAPE_0F, ESCAPE_0F38, ESCAPE_0F3A, ESCAPE_3DNOW,
+    ESCAPE_VEX2, ESCAPE_VEX3, ESCAPE_EVEX, ESCAPE_XOP, ESCAPE_CLASSES
+};
+
+static const char* escape_class_names[ESCAPE_CLASSES] = {
+    "none", "0F", "0F38", "0F3A", "3DNow", "VEX2", "VEX3", "EVEX", "XOP"
+};
+
+
+static inline bool is_prefix_byte( uint8_t b ) {
+    switch( b ) {
+        case 0x26: case 0x2E: case 0x36: case 0x3E: case 0x64: case 0x65:
+        case 0x66: case 0x67: case 0xF0: case 0xF2: case 0xF3:
+            return true;
+        default:
+            return (b & 0xF0) == 0x40;      // REX, counted in all modes
+    }
+}
+
+
+// Number of leading prefix bytes, at most 15.
+
+static inline int prefix_count( const uint8_t* buf ) {
+    int n = 0;
+    while( n < 15 && is_prefix_byte( buf[n] ) )
+        n++;
+    return n;
+}
+
+
+// Escape class of the bytes after the prefixes, by their
+// first bytes alone (C4/C5/62/8F count as VEX/EVEX/XOP in
+// every mode).
+
+int escape_class_of( const uint8_t* buf ) {
+    const uint8_t* p = buf + prefix_count( buf );
+    switch( p[0] ) {
+        case 0x0F:
+            return p[1] == 0x0F ? ESCAPE_3DNOW : p[1] == 0x38 ? ESCAPE_0F38 : p[1] == 0x3A ? ESCAPE_0F3A : ESCAPE_0F;
+        case 0xC5: return ESCAPE_VEX2;
+        case 0xC4: return ESCAPE_VEX3;
+        case 0x62: return ESCAPE_EVEX;
+        case 0x8F: return ESCAPE_XOP;
+        default:   return ESCAPE_NONE;
+    }
+}
+
+
+#define STACK_DEPTH_SIZE (256 * 1024)
+#define STACK_PAINT 0xA5A5A5A5A5A5A5A5ull
+
+enum stack_stage { STACK_IDLE, STACK_DECODE, STACK_FORMAT, STACK_STAGES };
+
+static const char* stack_stage_names[STACK_STAGES] = { "empty call", "decode", "format" };
+
+struct stack_record {
+    uint64_t samples;
+    uint64_t depth_sum;
+    size_t max_depth;
+    int bits;
+    uint8_t bytes[16];
+};
+
+struct stack_depth_state {
+    int interval;
+    int countdown;
+    uint64_t* stack;                // lowest word above the guard page
+    size_t words;
+    size_t entry_words;             // words below the frame of stack_depth_entry
+    size_t baseline;                // bytes used by an empty call
+    ucontext_t caller;
+    ucontext_t callee;
+    int stage;                      // running on the probe stack, else STACK_IDLE
+    const ZydisDecoder* decoder;
+    const uint8_t* buf;
+    ZyanStatus status;
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    char text[256];
+    stack_record records[STACK_STAGES][ESCAPE_CLASSES];
+};
+
+stack_depth_state* stack_depth = NULL;
+
+
+// A local one call below the caller: everything at or above
+// it belongs to the caller's frame.
+
+static __attribute__((noinline)) uintptr_t stack_depth_mark(void) {
+    volatile uint8_t mark = 0;
+    return (uintptr_t)&mark;
+}
+
+
+// Entry of the probe stack: runs the requested stage and
+// switches back, forever. Its frame stays live while it is
+// switched out, so it is measured once on entry and never
+// repainted; it keeps nothing else on the probe stack.
+
+static void stack_depth_entry(void) {
+    stack_depth->entry_words = (stack_depth_mark() - (uintptr_t)stack_depth->stack) / sizeof(uint64_t);
+    for(;;) {
+        if( stack_depth->stage == STACK_DECODE )
+            stack_depth->status = ZydisDecoderDecodeFull( stack_depth->decoder, stack_depth->buf, 64,
+                &stack_depth->instr, stack_depth->operands,
+                ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        else if( stack_depth->stage == STACK_FORMAT )
+            stack_depth->status = ZydisFormatterFormatInstruction( &formatter_intel,
+                &stack_depth->instr, stack_depth->operands, stack_depth->instr.operand_count_visible,
+                stack_depth->text, sizeof(stack_depth->text), 0, NULL );
+        swapcontext( &stack_depth->callee, &stack_depth->caller );
+    }
+}
+
+
+// Run a stage on the probe stack and return the bytes it
+// used below the entry frame; that part is repainted for
+// the next call.
+
+static size_t stack_depth_call( int stage ) {
+    stack_depth_state* s = stack_depth;
+    s->stage = stage;
+    swapcontext( &s->caller, &s->callee );
+    s->stage = STACK_IDLE;
+    size_t low = 0, i;
+    while( low < s->entry_words && s->stack[low] == STACK_PAINT )
+        low++;
+    for( i=low; i<s->entry_words; i++ )
+        s->stack[i] = STACK_PAINT;
+    return (s->entry_words - low) * sizeof(uint64_t);
+}
+
+
+void print_stack_depth_context(void) {
+    if( stack_depth && stack_depth->stage != STACK_IDLE )
+        printf("On the --stack-depth probe stack, in the %s stage\n",
+            stack_stage_names[stack_depth->stage] );
+}
+
+
+void init_stack_depth( int interval ) {
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    void* p = mmap( NULL, STACK_DEPTH_SIZE + page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED || mprotect( p, page, PROT_NONE ) ) {
+        printf("Cannot map the --stack-depth probe stack: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+    stack_depth = (stack_depth_state*)calloc( 1, sizeof(stack_depth_state) );
+    stack_depth->interval = interval;
+    stack_depth->countdown = interval;
+    stack_depth->stack = (uint64_t*)((uint8_t*)p + page);
+    stack_depth->words = STACK_DEPTH_SIZE / sizeof(uint64_t);
+
+    // an overflow faults on the guard page; report it from
+    // a stack that still has room
+    stack_t ss;
+    ss.ss_size = 64 * 1024;
+    ss.ss_sp = malloc( ss.ss_size );
+    ss.ss_flags = 0;
+    struct sigaction sa;
+    sigemptyset( &sa.sa_mask );
+    sa.sa_handler = sigabrt_handler;
+    sa.sa_flags = SA_ONSTACK;
+    if( !ss.ss_sp || sigaltstack( &ss, NULL ) ) {
+        printf("Cannot set up the signal stack: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+    sigaction( SIGSEGV, &sa, NULL );
+    sigaction( SIGBUS,  &sa, NULL );
+    crash_context_printer = print_stack_depth_context;
+
+    getcontext( &stack_depth->callee );
+    stack_depth->callee.uc_stack.ss_sp = stack_depth->stack;
+    stack_depth->callee.uc_stack.ss_size = STACK_DEPTH_SIZE;
+    stack_depth->callee.uc_link = NULL;
+    makecontext( &stack_depth->callee, stack_depth_entry, 0 );
+    stack_depth_call( STACK_IDLE );     // the unpainted stack counts as used, and gets painted
+    stack_depth->baseline = stack_depth_call( STACK_IDLE );
+}
+
+
+static void stack_depth_record( int stage, int escape, int decoder_index, const uint8_t* buf, size_t depth ) {
+    stack_record* r = &stack_depth->records[stage][escape];
+    depth = depth > stack_depth->baseline ? depth - stack_depth->baseline : 0;
+    r->samples++;
+    r->depth_sum += depth;
+    if( r->samples == 1 || depth > r->max_depth ) {
+        r->max_depth = depth;
+        r->bits = decoder_bits[decoder_index];
+        memcpy( r->bytes, buf, sizeof(r->bytes) );
+    }
+}
+
+
+void stack_depth_sample( int decoder_index, const uint8_t* buf ) {
+    int escape = escape_class_of( buf );
+    stack_depth->decoder = &decoders[decoder_index];
+    stack_depth->buf = buf;
+    stack_depth_record( STACK_DECODE, escape, decoder_index, buf, stack_depth_call( STACK_DECODE ) );
+    if( ZYAN_FAILED(stack_depth->status) )
+        return;
+    stack_depth_record( STACK_FORMAT, escape, decoder_index, buf, stack_depth_call( STACK_FORMAT ) );
+}
+
+
+void stack_depth_report(void) {
+    int stage, k, i;
+    printf("Stack depth in bytes, less %zu for an empty call (%d KiB probe stack):\n",
+        stack_depth->baseline, STACK_DEPTH_SIZE / 1024 );
+    printf("  %-7s %-6s %10s %8s %8s  deepest input\n", "stage", "escape", "samples", "mean", "max" );
+    for( stage=STACK_DECODE; stage<STACK_STAGES; stage++ ) {
+        for( k=0; k<ESCAPE_CLASSES; k++ ) {
+            const stack_record* r = &stack_depth->records[stage][k];
+            if( !r->samples )
+                continue;
+            printf("  %-7s %-6s %10llu %8.0f %8zu  %d-bit", stack_stage_names[stage], escape_class_names[k],
+                (unsigned long long)r->samples, (double)r->depth_sum / r->samples, r->max_depth, r->bits );
+            for( i=0; i<16; i++ )
+                printf(" %02X", r->bytes[i] );
+            printf("\n");
+        }
+    }
+}
+
+
+
+// ---------------------------------------------------
+//   Golden-output digests (--digest-out). Every decode
+//   result is reduced to a 64-bit digest of its
+//   version-independent parts: status, length,
+//   mnemonic and register names as strings, operand
+//   shapes and values, attributes, and the Intel text.
+//   Status codes, operand and memory types, actions
+//   and attributes are numbered by Zydis and may move
+//   between versions, so they go through the fixed
+//   tables below first; anything not listed there is
+//   left out of the digest.
+//   The digests are streamed in iteration order, so
+//   that the iteration is the record index and each
+//   input costs 8 bytes. Digests are random bits and
+//   do not compress; leaving the iteration implicit is
+//   what halves the stream, and fixed-size records let
+//   --digest-diff compare two streams at memory speed.
+// ---------------------------------------------------
+
+#define DIGEST_MAGIC 0x5A594447u    // "ZYDG"
+#define DIGEST_VERSION 2
+#define DIGEST_BUFFER 65536         // digests per write()
+
+struct digest_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seed;
+    uint32_t reserved;
+    uint64_t zydis_version;
+    uint64_t count;                 // filled in on close
+};
+
+struct digest_stream {
+    int fd;
+    uint64_t count;
+    size_t fill;
+    uint64_t buffer[DIGEST_BUFFER];
+};
+
+digest_stream* digests = NULL;
+
+
+static inline uint64_t digest_bytes( uint64_t h, const void* data, size_t n ) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t i;
+    for( i=0; i<n; i++ )
+        h = (h ^ p[i]) * 0x100000001B3ull;     // FNV-1a
+    return h;
+}
+
+
+static inline uint64_t digest_u64( uint64_t h, uint64_t v ) {
+    return digest_bytes( h, &v, sizeof(v) );
+}
+
+
+static inline uint64_t digest_string( uint64_t h, const char* str ) {
+    return str ? digest_bytes( h, str, strlen( str ) + 1 ) : digest_u64( h, 0 );
+}
+
+
+static inline uint64_t digest_register( uint64_t h, ZydisRegister reg ) {
+    return digest_string( h, reg == ZYDIS_REGISTER_NONE ? "" : ZydisRegisterGetString( reg ) );
+}
+
+
+// Harness-owned numbering of the decoder status: 0 for
+// success, 1.. for the Zydis errors by name, and one
+// catch-all each for other Zydis and non-Zydis errors.
+static uint64_t digest_status_id( ZyanStatus status ) {
+    if( ZYAN_SUCCESS(status) )
+        return 0;
+    switch( status ) {
+        case ZYDIS_STATUS_NO_MORE_DATA:             return 1;
+        case ZYDIS_STATUS_DECODING_ERROR:           return 2;
+        case ZYDIS_STATUS_INSTRUCTION_TOO_LONG:     return 3;
+        case ZYDIS_STATUS_BAD_REGISTER:             return 4;
+        case ZYDIS_STATUS_ILLEGAL_LOCK:             return 5;
+        case ZYDIS_STATUS_ILLEGAL_LEGACY_PFX:       return 6;
+        case ZYDIS_STATUS_ILLEGAL_REX:              return 7;
+        case ZYDIS_STATUS_INVALID_MAP:              return 8;
+        case ZYDIS_STATUS_MALFORMED_EVEX:           return 9;
+        case ZYDIS_STATUS_MALFORMED_MVEX:           return 10;
+        case ZYDIS_STATUS_INVALID_MASK:             return 11;
+        case ZYDIS_STATUS_IMPOSSIBLE_INSTRUCTION:   return 12;
+        default:
+            return ZYAN_STATUS_MODULE(status) == ZYAN_MODULE_ZYDIS ? 13 : 14;
+    }
+}
+
+
+static uint64_t digest_operand_type_id( ZydisOperandType type ) {
+    switch( type ) {
+        case ZYDIS_OPERAND_TYPE_REGISTER:   return 1;
+        case ZYDIS_OPERAND_TYPE_MEMORY:     return 2;
+        case ZYDIS_OPERAND_TYPE_POINTER:    return 3;
+        case ZYDIS_OPERAND_TYPE_IMMEDIATE:  return 4;
+        default:                            return 0;
+    }
+}
+
+
+static uint64_t digest_memory_type_id( ZydisMemoryOperandType type ) {
+    switch( type ) {
+        case ZYDIS_MEMOP_TYPE_MEM:  return 1;
+        case ZYDIS_MEMOP_TYPE_AGEN: return 2;
+        case ZYDIS_MEMOP_TYPE_MIB:  return 3;
+        case ZYDIS_MEMOP_TYPE_VSIB: return 4;
+        default:                    return 0;
+    }
+}
+
+
+static uint64_t digest_actions_bits( ZydisOperandActions actions ) {
+    return ((actions & ZYDIS_OPERAND_ACTION_READ)      ? 1 : 0)
+         | ((actions & ZYDIS_OPERAND_ACTION_WRITE)     ? 2 : 0)
+         | ((actions & ZYDIS_OPERAND_ACTION_CONDREAD)  ? 4 : 0)
+         | ((actions & ZYDIS_OPERAND_ACTION_CONDWRITE) ? 8 : 0);
+}
+
+
+// The attribute bit positions are Zydis's; the position
+// in this table is the harness's. Append only.
+static const ZydisInstructionAttributes digest_attributes[] = {
+    ZYDIS_ATTRIB_HAS_MODRM,
+    ZYDIS_ATTRIB_HAS_SIB,
+    ZYDIS_ATTRIB_HAS_REX,
+    ZYDIS_ATTRIB_HAS_XOP,
+    ZYDIS_ATTRIB_HAS_VEX,
+    ZYDIS_ATTRIB_HAS_EVEX,
+    ZYDIS_ATTRIB_HAS_MVEX,
+    ZYDIS_ATTRIB_IS_RELATIVE,
+    ZYDIS_ATTRIB_IS_PRIVILEGED,
+    ZYDIS_ATTRIB_HAS_LOCK,
+    ZYDIS_ATTRIB_HAS_REP,
+    ZYDIS_ATTRIB_HAS_REPE,
+    ZYDIS_ATTRIB_HAS_REPNE,
+    ZYDIS_ATTRIB_HAS_BND,
+    ZYDIS_ATTRIB_HAS_XACQUIRE,
+    ZYDIS_ATTRIB_HAS_XRELEASE,
+    ZYDIS_ATTRIB_HAS_BRANCH_NOT_TAKEN,
+    ZYDIS_ATTRIB_HAS_BRANCH_TAKEN,
+    ZYDIS_ATTRIB_HAS_NOTRACK,
+    ZYDIS_ATTRIB_HAS_SEGMENT_CS,
+    ZYDIS_ATTRIB_HAS_SEGMENT_SS,
+    ZYDIS_ATTRIB_HAS_SEGMENT_DS,
+    ZYDIS_ATTRIB_HAS_SEGMENT_ES,
+    ZYDIS_ATTRIB_HAS_SEGMENT_FS,
+    ZYDIS_ATTRIB_HAS_SEGMENT_GS,
+    ZYDIS_ATTRIB_HAS_OPERANDSIZE,
+    ZYDIS_ATTRIB_HAS_ADDRESSSIZE
+};
+
+
+static uint64_t digest_attribute_bits( ZydisInstructionAttributes attributes ) {
+    uint64_t bits = 0;
+    size_t i;
+    for( i=0; i<sizeof(digest_attributes)/sizeof(digest_attributes[0]); i++ )
+        if( attributes & digest_attributes[i] )
+            bits |= 1ull << i;
+    return bits;
+}
+
+
+uint64_t decode_digest(
+    ZyanStatus status,
+    const ZydisDecodedInstruction* instr,
+    const ZydisDecodedOperand* operands ) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    int i;
+    h = digest_u64( h, digest_status_id( status ) );
+    if( ZYAN_FAILED(status) )
+        return h;
+    h = digest_u64( h, instr->length );
+    h = digest_string( h, ZydisMnemonicGetString( instr->mnemonic ) );
+    h = digest_u64( h, digest_attribute_bits( instr->attributes ) );
+    h = digest_u64( h, instr->operand_count_visible );
+    for( i=0; i<instr->operand_count_visible; i++ ) {
+        const ZydisDecodedOperand* op = &operands[i];
+        h = digest_u64( h, (digest_operand_type_id( op->type ) << 32) ^ ((uint64_t)op->size << 8)
+            ^ digest_actions_bits( op->actions ) );
+        switch( op->type ) {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                h = digest_register( h, op->reg.value );
+                break;
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                h = digest_u64( h, (digest_memory_type_id( op->mem.type ) << 8) ^ op->mem.scale );
+                h = digest_register( h, op->mem.segment );
+                h = digest_register( h, op->mem.base );
+                h = digest_register( h, op->mem.index );
+                h = digest_u64( h, (uint64_t)op->mem.disp.value );
+                break;
+            case ZYDIS_OPERAND_TYPE_POINTER:
+                h = digest_u64( h, ((uint64_t)op->ptr.segment << 32) ^ op->ptr.offset );
+                break;
+            case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+                h = digest_u64( h, op->imm.value.u );
+                h = digest_u64( h, ((uint64_t)op->imm.is_signed << 1) ^ op->imm.is_relative );
+                break;
+            default:
+                break;
+        }
+    }
+    char text[256];
+    if( ZYAN_SUCCESS( ZydisFormatterFormatInstruction( &formatter_intel, instr, operands,
+            instr->operand_count_visible, text, sizeof(text), 0, NULL ) ) )
+        h = digest_string( h, text );
+    return h;
+}
+
+
+bool digest_stream_open( const char* path, unsigned int seed ) {
+    int fd = open( path, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    if( fd < 0 ) {
+        printf("Cannot create digest stream %s: %s\n", path, strerror(errno) );
+        return false;
+    }
+    digest_header header;
+    memset( &header, 0, sizeof(header) );
+    header.magic = DIGEST_MAGIC;
+    header.version = DIGEST_VERSION;
+    header.seed = seed;
+    header.zydis_version = ZydisGetVersion();
+    if( write( fd, &header, sizeof(header) ) != sizeof(header) ) {
+        printf("Cannot write digest stream %s: %s\n", path, strerror(errno) );
+        close( fd );
+        return false;
+    }
+    digests = (digest_stream*)malloc( sizeof(digest_stream) );
+    digests->fd = fd;
+    digests->count = 0;
+    digests->fill = 0;
+    return true;
+}
+
+
+void digest_stream_flush(void) {
+    uint64_t t = trace_begin();
+    size_t bytes = digests->fill * sizeof(uint64_t);
+    if( bytes && write( digests->fd, digests->buffer, bytes ) != (ssize_t)bytes )
+        invariant_failed( "cannot write digest stream: %s", strerror(errno) );
+    digests->fill = 0;
+    trace_end( "digest write", t, (long long)bytes );
+}
+
+
+static inline void digest_stream_append( uint64_t digest ) {
+    digests->buffer[digests->fill++] = digest;
+    digests->count++;
+    if( digests->fill == DIGEST_BUFFER )
+        digest_stream_flush();
+}
+
+
+void digest_stream_close(void) {
+    if( !digests )
+        return;
+    digest_stream_flush();
+    if( pwrite( digests->fd, &digests->count, sizeof(digests->count),
+                offsetof(digest_header, count) ) != sizeof(digests->count) )
+        printf("Cannot finish digest stream: %s\n", strerror(errno) );
+    close( digests->fd );
+    free( digests );
+    digests = NULL;
+}
+
+
+
+// ---------------------------------------------------
+//   Concurrency stress. Worker threads all decode and
+//   format through the one set of decoders built in
+//   main() and the shared formatters, and through
+//   private per-thread copies of the same objects,
+//   alternating which goes first. Results must match
+//   exactly; a difference would expose hidden mutable
+//   state in objects that are supposed to be read-only
+//   after init. The cycles spent on the shared and the
+//   private objects are reported side by side, which
+//   shows any cost of sharing them.
+// ---------------------------------------------------
+
+struct stress_worker {
+    alignas(64) pthread_t thread;
+    int index;
+    unsigned int rand_state;
+    long long iterations;
+    uint64_t shared_cycles;
+    uint64_t private_cycles;
+    uint64_t decodes;
+    uint64_t formats;
+};
+
+
+struct stress_objects {
+    const ZydisDecoder* decoders[DECODER_COUNT];
+    const ZydisFormatter* formatters[3];
+};
+
+
+struct stress_result {
+    ZyanStatus status;
+    ZyanStatus format_status;
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    char text[256];
+};
+
+
+static inline uint64_t stress_decode_and_format(
+    const stress_objects* objects,
+    int decoder_index,
+    int formatter_index,
+    const uint8_t* buf,
+    stress_result* result ) {
+    uint64_t t0 = read_cycle_counter();
+    result->status = ZydisDecoderDecodeFull(
+        objects->decoders[decoder_index], buf, 64, &result->instr, result->operands,
+        ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+    result->format_status = ZYAN_STATUS_FAILED;
+    if( ZYAN_SUCCESS(result->status) ) {
+        result->format_status = ZydisFormatterFormatInstruction(
+            objects->formatters[formatter_index], &result->instr, result->operands,
+            result->instr.operand_count_visible, result->text, sizeof(result->text), 0, NULL );
+    }
+    return read_cycle_counter() - t0;
+}
+
+
+static void stress_compare( const stress_result* shared, const stress_result* own ) {
+    if( shared->status != own->status )
+        invariant_failed( "shared decoder status 0x%08X, private copy 0x%08X",
+            shared->status, own->status );
+    if( ZYAN_FAILED(shared->status) )
+        return;
+    if( memcmp( &shared->instr, &own->instr, sizeof(shared->instr) )
+     || memcmp( shared->operands, own->operands,
+                shared->instr.operand_count_visible * sizeof(ZydisDecodedOperand) ) )
+        invariant_failed( "shared and private decoders produced different output" );
+    if( shared->format_status != own->format_status
+     || ( ZYAN_SUCCESS(shared->format_status) && strcmp( shared->text, own->text ) ) )
+        invariant_failed( "shared formatter gave \"%s\", private copy \"%s\"",
+            shared->text, own->text );
+}
+
+
+void* stress_worker_main( void* arg ) {
+    stress_worker* w = (stress_worker*)arg;
+    long long n;
+    int i;
+    thread_rand_state = &w->rand_state;
+
+    // private copies of the objects built in main()
+    ZydisDecoder own_decoders[DECODER_COUNT];
+    ZydisFormatter own_formatters[3];
+    memcpy( own_decoders, decoders, sizeof(own_decoders) );
+    own_formatters[0] = formatter_intel;
+    own_formatters[1] = formatter_att;
+    own_formatters[2] = formatter_masm;
+
+    stress_objects shared, own;
+    for( i=0; i<DECODER_COUNT; i++ ) {
+        shared.decoders[i] = &decoders[i];
+        own.decoders[i] = &own_decoders[i];
+    }
+    shared.formatters[0] = &formatter_intel;
+    shared.formatters[1] = &formatter_att;
+    shared.formatters[2] = &formatter_masm;
+    for( i=0; i<3; i++ )
+        own.formatters[i] = &own_formatters[i];
+
+    stress_result shared_result, own_result;
+    for( n=0; n<w->iterations; n++ ) {
+        uint8_t buf[64];
+        int decoder_index = fuzz_rand() & (FUZZ_DECODER_COUNT-1);
+        int formatter_index = fuzz_rand() % 3;
+        generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+        record_decoder_input( &decoders[decoder_index], buf );
+
+        if( n & 1 ) {
+            w->shared_cycles  += stress_decode_and_format( &shared, decoder_index, formatter_index, buf, &shared_result );
+            w->private_cycles += stress_decode_and_format( &own, decoder_index, formatter_index, buf, &own_result );
+        } else {
+            w->private_cycles += stress_decode_and_format( &own, decoder_index, formatter_index, buf, &own_result );
+            w->shared_cycles  += stress_decode_and_format( &shared, decoder_index, formatter_index, buf, &shared_result );
+        }
+        stress_compare( &shared_result, &own_result );
+        w->decodes++;
+        w->formats += ZYAN_SUCCESS(shared_result.status);
+    }
+    return NULL;
+}
+
+
+
+// ---------------------------------------------------
+//   Commandline options. A bare number is taken as
+//   the random seed, as it always has been.
+// ---------------------------------------------------
+
+#define MAX_REPLAY_BINARIES 8
+#define MAX_CORPUS_FILES 256
+
+struct fuzzer_options {
+    unsigned int seed;
+    long long iterations;
+    int profile_interval;   // 0 = profiler disabled
+    bool quiet;             // no breadcrumbs
+    int campaign_fast_workers;
+    int campaign_sanitizer_workers;
+    int replay_binary_count;
+    const char* replay_binaries[MAX_REPLAY_BINARIES];
+    const char* replay_queue_name;  // run as a sanitizer replay worker
+    int diff_library_count;
+    const char* diff_libraries[MAX_DIFF_LIBRARIES];
+    bool utils;             // utility-API stage
+    bool tokens;            // formatter token-stream stage
+    bool hooks;             // formatter hook stage
+    bool encoder;           // fuzz the encoder instead of the decoder
+    bool seeds;             // mutate encoder-synthesized seeds
+    int poison_interval;    // 0 = no poison double decode
+    int operand_guard_interval;     // 0 = no guarded operand arrays
+    int threads;
+    bool fuzz_blocks;       // deterministic block mode, see run_fuzz_blocks()
+    long long block;        // run only this block, or -1
+    bool board;             // publish stats to the shared-memory board
+    const char* crash_record_path;  // file-backed record of recent inputs
+    const char* postmortem_path;    // print a crash record and exit
+    const char* digest_out;         // stream per-iteration digests here
+    const char* digest_diff;        // OLD,NEW digest streams to compare
+    int objdump_interval;           // 0 = no objdump oracle
+    int hw_interval;                // 0 = no hardware oracle
+    int stack_depth_interval;       // 0 = no stack-depth profiling
+    const char* entropy_file;       // generate one input from this file
+    const char* patterns_file;      // generate from encoding patterns
+    const char* trace_path;         // Chrome trace of the stage timeline
+    bool shared_stress;     // concurrency stress on shared objects
+    int bench_scaling;      // max thread count of the scaling benchmark
+    bool bench_generators;  // benchmark the input generator variants
+    uint64_t perf_raw;      // raw PMU event for the scaling benchmark
+    const char* save_corpus;    // append novel inputs to this file
+    const char* distill_output; // distill the --corpus files into this file
+    int corpus_count;
+    const char* corpus_files[MAX_CORPUS_FILES];
+};
+
+
+void print_usage( const char* progname ) {
+    printf("Usage: %s [options] [seed]\n", progname );
+    printf("  --iterations=N   run N iterations (default 2000000000)\n");
+    printf("  --profile[=N]    time every Nth iteration (default 1024) and\n");
+    printf("                   report a per-phase cost breakdown\n");
+    printf("  --campaign=F:S   run F fast fuzzing processes and S sanitizer\n");
+    printf("                   processes replaying their interesting inputs\n");
+    printf("  --replay-binary=PATH\n");
+    printf("                   sanitizer build used by --campaign; may be\n");
+    printf("                   given several times to mix sanitizers\n");
+    printf("  --diff-lib=PATH  decode every input with each of two or more\n");
+    printf("                   Zydis shared libraries and report differences\n");
+    printf("  --utils          exercise and check the utility APIs (absolute\n");
+    printf("                   addresses, segments, flags, register tables)\n");
+    printf("                   on every successful decode\n");
+    printf("  --tokens         tokenize every successful decode and check the\n");
+    printf("                   token chain against the formatted text\n");
+    printf("  --hooks          format every successful decode with one of a\n");
+    printf("                   pool of formatters with randomized hooks\n");
+    printf("  --encoder        fuzz the encoder with random encoder requests,\n");
+    printf("                   re-decoding every successful encoding\n");
+    printf("  --seeds          synthesize a valid seed per mnemonic and operand\n");
+    printf("                   form with the encoder, and draw half of the\n");
+    printf("                   inputs from mutations of those seeds\n");
+    printf("  --poison[=N]     decode every Nth input (default 16) twice into\n");
+    printf("                   differently poisoned outputs and compare them\n");
+    printf("  --operand-guard[=N]  decode every Nth input (default 16) again\n");
+    printf("                   with a random operand_count, into an operand\n");
+    printf("                   array that ends at a PROT_NONE page\n");
+    printf("  --threads=N      number of worker threads (default 1); the fuzz\n");
+    printf("                   loop then runs in 1M-iteration blocks seeded from\n");
+    printf("                   (seed, block), with the same results for any N\n");
+    printf("  --block=B        run only block B of the block mode, to reproduce it\n");
+    printf("  --board          publish live counters to /zydis-fuzz-<pid> for\n");
+    printf("                   zydis_fuzz_top, instead of printing breadcrumbs\n");
+    printf("  --crash-record=FILE  keep the last inputs of every thread in FILE,\n");
+    printf("                   readable even after SIGKILL; campaign workers\n");
+    printf("                   use FILE.<pid>\n");
+    printf("  --postmortem=FILE    print the inputs in a crash record and exit\n");
+    printf("  --digest-out=FILE    write a 64-bit digest of every decode result\n");
+    printf("  --digest-diff=OLD,NEW  list the iterations whose digests differ\n");
+    printf("  --objdump[=N]    compare every Nth input (default 256) against\n");
+    printf("                   binutils objdump, run once per %d inputs\n", OBJDUMP_BATCH );
+    printf("  --trace=FILE     write a Chrome trace JSON timeline of the stages\n");
+    printf("  --patterns=FILE  generate inputs from the encoding patterns in FILE\n");
+    printf("  --entropy-file=FILE  generate one input from the bytes of FILE\n");
+    printf("                   instead of the PRNG, e.g. for AFL with @@\n");
+    printf("  --hw-oracle[=N]  execute every Nth 64-bit input (default 256) on\n");
+    printf("                   this CPU and compare its length with Zydis\n");
+    printf("  --stack-depth[=N]  decode and format every Nth input (default 256)\n");
+    printf("                   on a painted stack and report the deepest\n");
+    printf("                   input per escape class\n");
+    printf("  --shared-stress  decode and format on all threads through one\n");
+    printf("                   shared set of decoders and formatters, checking\n");
+    printf("                   against private per-thread copies\n");
+    printf("  --bench-scaling[=N]  measure decode throughput at 1, 2, 4 .. N\n");
+    printf("                   threads (default: all CPUs), --iterations per thread\n");
+    printf("  --bench-generators  measure --iterations inputs/sec of each generator\n");
+    printf("                   variant and compare their input distributions\n");
+    printf("  --perf-raw=EVENT raw PMU event (hex) counted by --bench-scaling,\n");
+    printf("                   e.g. a HITM event of the CPU at hand\n");
+    printf("  --save-corpus=FILE  append inputs with novel decode features to FILE\n");
+    printf("  --distill=OUT    merge the --corpus=FILE inputs (repeatable), drop\n");
+    printf("                   duplicates and write a small subset covering all\n");
+    printf("                   their decode features to OUT; uses --threads\n");
+}
+
+
+int parse_options( int argc, char *argv[], fuzzer_options* opts ) {
+    int i;
+    memset( opts, 0, sizeof(*opts) );
+    opts->iterations = 2000000000;
+    opts->threads = 1;
+    opts->block = -1;
+    for( i=1; i<argc; i++ ) {
+        const char* arg = argv[i];
+        if( !strncmp( arg, "--iterations=", 13 ) ) {
+            opts->iterations = atoll( arg + 13 );
+        } else if( !strcmp( arg, "--profile" ) ) {
+            opts->profile_interval = 1024;
+        } else if( !strncmp( arg, "--profile=", 10 ) ) {
+            opts->profile_interval = atoi( arg + 10 );
+            if( opts->profile_interval < 1 )
+                opts->profile_interval = 1;
+        } else if( !strncmp( arg, "--campaign=", 11 ) ) {
+            if( sscanf( arg + 11, "%d:%d", &opts->campaign_fast_workers,
+                        &opts->campaign_sanitizer_workers ) != 2
+                || opts->campaign_fast_workers < 1
+                || opts->campaign_sanitizer_workers < 0 ) {
+                printf("--campaign expects F:S, e.g. --campaign=14:2\n");
+                return -1;
+            }
+        } else if( !strncmp( arg, "--replay-binary=", 16 ) ) {
+            if( opts->replay_binary_count == MAX_REPLAY_BINARIES ) {
+                printf("At most %d replay binaries are supported\n", MAX_REPLAY_BINARIES );
+                return -1;
+            }
+            opts->replay_binaries[opts->replay_binary_count++] = arg + 16;
+        } else if( !strncmp( arg, "--replay-queue=", 15 ) ) {
+            opts->replay_queue_name = arg + 15;
+        } else if( !strcmp( arg, "--utils" ) ) {
+            opts->utils = true;
+        } else if( !strcmp( arg, "--tokens" ) ) {
+            opts->tokens = true;
+        } else if( !strcmp( arg, "--hooks" ) ) {
+            opts->hooks = true;
+        } else if( !strcmp( arg, "--encoder" ) ) {
+            opts->encoder = true;
+        } else if( !strcmp( arg, "--seeds" ) ) {
+            opts->seeds = true;
+        } else if( !strncmp( arg, "--threads=", 10 ) ) {
+            opts->threads = atoi( arg + 10 );
+            if( opts->threads < 1 )
+                opts->threads = 1;
+            opts->fuzz_blocks = true;
+        } else if( !strncmp( arg, "--block=", 8 ) ) {
+            opts->block = atoll( arg + 8 );
+            if( opts->block < 0 )
+                opts->block = 0;
+            opts->fuzz_blocks = true;
+        } else if( !strcmp( arg, "--board" ) ) {
+            opts->board = true;
+        } else if( !strncmp( arg, "--crash-record=", 15 ) ) {
+            opts->crash_record_path = arg + 15;
+        } else if( !strncmp( arg, "--postmortem=", 13 ) ) {
+            opts->postmortem_path = arg + 13;
+        } else if( !strcmp( arg, "--objdump" ) ) {
+            opts->objdump_interval = 256;
+        } else if( !strncmp( arg, "--objdump=", 10 ) ) {
+            opts->objdump_interval = atoi( arg + 10 );
+            if( opts->objdump_interval < 1 )
+                opts->objdump_interval = 1;
+        } else if( !strcmp( arg, "--bench-generators" ) ) {
+            opts->bench_generators = true;
+        } else if( !strncmp( arg, "--trace=", 8 ) ) {
+            opts->trace_path = arg + 8;
+        } else if( !strncmp( arg, "--patterns=", 11 ) ) {
+            opts->patterns_file = arg + 11;
+        } else if( !strncmp( arg, "--entropy-file=", 15 ) ) {
+            opts->entropy_file = arg + 15;
+        } else if( !strcmp( arg, "--hw-oracle" ) ) {
+            opts->hw_interval = 256;
+        } else if( !strncmp( arg, "--hw-oracle=", 12 ) ) {
+            opts->hw_interval = atoi( arg + 12 );
+            if( opts->hw_interval < 1 )
+                opts->hw_interval = 1;
+        } else if( !strcmp( arg, "--stack-depth" ) ) {
+            opts->stack_depth_interval = 256;
+        } else if( !strncmp( arg, "--stack-depth=", 14 ) ) {
+            opts->stack_depth_interval = atoi( arg + 14 );
+            if( opts->stack_depth_interval < 1 )
+                opts->stack_depth_interval = 1;
+        } else if( !strncmp( arg, "--digest-out=", 13 ) ) {
+            opts->digest_out = arg + 13;
+        } else if( !strncmp( arg, "--digest-diff=", 14 ) ) {
+            opts->digest_diff = arg + 14;
+        } else if( !strcmp( arg, "--shared-stress" ) ) {
+            opts->shared_stress = true;
+        } else if( !strcmp( arg, "--bench-scaling" ) ) {
+            opts->bench_scaling = (int)sysconf( _SC_NPROCESSORS_ONLN );
+        } else if( !strncmp( arg, "--bench-scaling=", 16 ) ) {
+            opts->bench_scaling = atoi( arg + 16 );
+            if( opts->bench_scaling < 1 )
+                opts->bench_scaling = 1;
+        } else if( !strncmp( arg, "--perf-raw=", 11 ) ) {
+            opts->perf_raw = strtoull( arg + 11, NULL, 16 );
+        } else if( !strncmp( arg, "--save-corpus=", 14 ) ) {
+            opts->save_corpus = arg + 14;
+        } else if( !strncmp( arg, "--distill=", 10 ) ) {
+            opts->distill_output = arg + 10;
+        } else if( !strncmp( arg, "--corpus=", 9 ) ) {
+            if( opts->corpus_count == MAX_CORPUS_FILES ) {
+                printf("At most %d corpus files are supported\n", MAX_CORPUS_FILES );
+                return -1;
+            }
+            opts->corpus_files[opts->corpus_count++] = arg + 9;
+        } else if( !strcmp( arg, "--poison" ) ) {
+            opts->poison_interval = 16;
+        } else if( !strncmp( arg, "--poison=", 9 ) ) {
+            opts->poison_interval = atoi( arg + 9 );
+            if( opts->poison_interval < 1 )
+                opts->poison_interval = 1;
+        } else if( !strcmp( arg, "--operand-guard" ) ) {
+            opts->operand_guard_interval = 16;
+        } else if( !strncmp( arg, "--operand-guard=", 16 ) ) {
+            opts->operand_guard_interval = atoi( arg + 16 );
+            if( opts->operand_guard_interval < 1 )
+                opts->operand_guard_interval = 1;
+        } else if( !strncmp( arg, "--diff-lib=", 11 ) ) {
+            if( opts->diff_library_count == MAX_DIFF_LIBRARIES ) {
+                printf("At most %d diff libraries are supported\n", MAX_DIFF_LIBRARIES );
+                return -1;
+            }
+            opts->diff_libraries[opts->diff_library_count++] = arg + 11;
+        } else if( arg[0] != '-' ) {
+            opts->seed = atoi( arg );
+        } else {
+            printf("Unknown option: %s\n", arg );
+            print_usage( argv[0] );
+            return -1;
+        }
+    }
+    if( opts->campaign_sanitizer_workers && !opts->replay_binary_count ) {
+        printf("--campaign with sanitizer workers needs --replay-binary\n");
+        return -1;
+    }
+    if( opts->diff_library_count == 1 ) {
+        printf("--diff-lib needs at least two libraries\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   The fuzz loop proper
+// ---------------------------------------------------
+
+// inputs and successful decodes per input source
+// (0 = generate_rand_instr, 1 = seed mutation)
+__thread uint64_t source_inputs[2];
+__thread uint64_t source_valid[2];
+
+
+// The next input and its decoder index; all randomness of the
+// input stream is drawn here.
+
+static inline int generate_fuzz_input( uint8_t buf[64], bool* from_seed ) {
+    *from_seed = seed_count && entropy_bits( 1 );
+    if( *from_seed )
+        return generate_seed_mutation( buf );
+    if( patterns )
+        return generate_pattern_input( buf );
+    int decoder_index = entropy_bits( 2 );     // FUZZ_DECODER_COUNT is 4
+    generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+    return decoder_index;
+}
+
+
+// One fuzz iteration: generate, decode, run the enabled stages.
+// t_start is the begin of a profiled iteration.
+
+static inline void fuzz_iteration(
+    const fuzzer_options* opts,
+    int* poison_countdown,
+    bool sampled,
+    uint64_t t_start ) {
+    uint8_t buf[64];
+    bool from_seed;
+    int decoder_index = generate_fuzz_input( buf, &from_seed );
+    ZydisDecoder *decoder_to_use = &decoders[decoder_index];
+    
+    ZydisDecodedInstruction instr1;
+    ZydisDecodedOperand operands1[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    ZyanStatus status;
+    bool poison = opts->poison_interval && --*poison_countdown == 0;
+    if( poison ) {
+        *poison_countdown = opts->poison_interval;
+        poison_decode_outputs( &instr1, operands1 );
+    }
+    if( sampled ) {
+        status = profiled_ZydisDecoderDecodeFull(
+            decoder_to_use,
+            buf,
+            64,
+            &instr1,
+            operands1,
+            ZYDIS_MAX_OPERAND_COUNT_VISIBLE,
+            ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY,
+            t_start );
+    } else if( novelty ) {
+        uint64_t t_decode = read_cycle_counter();
+        status = wrapped_ZydisDecoderDecodeFull(
+            decoder_to_use,
+            buf,
+            64,
+            &instr1,
+            operands1,
+            ZYDIS_MAX_OPERAND_COUNT_VISIBLE,
+            ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        campaign_observe( decoder_index, buf, status, &instr1,
+                          read_cycle_counter() - t_decode );
+    } else {
+        status = wrapped_ZydisDecoderDecodeFull(
+            decoder_to_use,
+            buf,
+            64,
+            &instr1,
+            operands1,
             ZYDIS_MAX_OPERAND_COUNT_VISIBLE,
             ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+    }
+
+    if( poison )
+        check_poison_decode( decoder_to_use, buf, status, &instr1, operands1 );
+    if( opts->operand_guard_interval && --operand_guard_countdown <= 0 ) {
+        operand_guard_countdown = opts->operand_guard_interval;
+        check_operand_guard( decoder_to_use, buf );
+    }
+
+    source_inputs[from_seed]++;
+    status_counts[board_status_bucket( status )]++;
+    if( digests )
+        digest_stream_append( decode_digest( status, &instr1, operands1 ) );
+    if( objdump_oracle && --objdump_oracle->countdown == 0 ) {
+        objdump_oracle->countdown = objdump_oracle->interval;
+        objdump_sample( decoder_index, buf );
+    }
+    if( hw_oracle && --hw_oracle->countdown == 0 ) {
+        hw_oracle->countdown = hw_oracle->interval;
+        hw_sample( decoder_index, buf );
+    }
+    if( stack_depth && --stack_depth->countdown == 0 ) {
+        stack_depth->countdown = stack_depth->interval;
+        stack_depth_sample( decoder_index, buf );
+    }
+    if( ZYAN_SUCCESS(status) ) {
+        source_valid[from_seed]++;
+        if( opts->utils )
+            check_utility_apis( &instr1, operands1 );
+        if( opts->tokens )
+            check_token_stream( &formatter_intel, &instr1, operands1 );
+        if( opts->hooks )
+            check_hooked_formatting( &instr1, operands1 );
+    }
+}
+
+
+void fuzz_report( const fuzzer_options* opts, long long iterations, double elapsed, double cycles_per_sec ) {
+    printf("\n%lld decodes in %.2f s (%.0f decodes/sec)\n",
+        iterations, elapsed, elapsed > 0 ? iterations / elapsed : 0.0 );
+    // same rate again, for scripts (make bench-lto)
+    printf("decodes/sec=%.0f\n", elapsed > 0 ? iterations / elapsed : 0.0 );
+    if( seed_count ) {
+        printf("Valid decodes: %.1f%% of generated inputs, %.1f%% of seed mutations\n",
+            source_inputs[0] ? 100.0 * source_valid[0] / source_inputs[0] : 0.0,
+            source_inputs[1] ? 100.0 * source_valid[1] / source_inputs[1] : 0.0 );
+    }
+    if( opts->poison_interval )
+        printf("%llu poison double decodes\n", (unsigned long long)poison_checks );
+    if( opts->operand_guard_interval )
+        printf("%llu guarded operand array decodes (%llu with too few operands)\n",
+            (unsigned long long)operand_guard_checks, (unsigned long long)operand_guard_truncated );
+    if( opts->utils )
+        printf("%llu utility API calls (%.0f calls/sec)\n",
+            (unsigned long long)utility_calls, elapsed > 0 ? utility_calls / elapsed : 0.0 );
+    if( opts->tokens )
+        printf("%llu tokens in %llu token streams (%.0f tokens/sec in the token path)\n",
+            (unsigned long long)tokens_walked, (unsigned long long)token_streams,
+            token_cycles ? tokens_walked * cycles_per_sec / token_cycles : 0.0 );
+    if( opts->hooks )
+        printf("%llu hooked formats (%llu failed), %llu hook calls (%.0f calls/sec)\n",
+            (unsigned long long)hooked_formats, (unsigned long long)hooked_format_failures,
+            (unsigned long long)hook_calls, elapsed > 0 ? hook_calls / elapsed : 0.0 );
+    if( objdump_oracle )
+        objdump_report( elapsed );
+    if( hw_oracle )
+        hw_oracle_report( elapsed );
+    if( stack_depth )
+        stack_depth_report();
+}
+
+
+void run_fuzz_loop( const fuzzer_options* opts ) {
+    long long i;
+    int poison_countdown = opts->poison_interval;
+
+    // ---------------------------------------------------
+    //   Main loop runs 2 billion iterations by default
+    // ---------------------------------------------------
+
+    double t_begin = wall_seconds();
+    uint64_t cycles_begin = read_cycle_counter();
+    uint64_t trace_chunk = trace_begin();
+    for(i=0;i<opts->iterations;i++) {
+        // Close the loop-overhead phase of the previous
+        // iteration if it was sampled, then decide
+        // whether to sample this one.
+        uint64_t t_start = 0;
+        bool sampled = false;
+        if( profile.interval ) {
+            if( profile.pending ) {
+                t_start = read_cycle_counter();
+                profile_add( PROFILE_LOOP, profile.last_end, t_start );
+                profile.pending = false;
+            }
+            if( --profile.countdown == 0 ) {
+                profile.countdown = profile.interval;
+                sampled = true;
+                t_start = read_cycle_counter();
+            }
+        }
+
+        fuzz_iteration( opts, &poison_countdown, sampled, t_start );
         
         // Print breadcrumbs for passed tests - one crumb per 1 million
         // tests passed, additional daya per 10 million tests.
-        int passed_tests = i+1;
+        long long passed_tests = i+1;
+        if( !(passed_tests % BOARD_PUBLISH_INTERVAL) ) {
+            trace_end( "fuzz", trace_chunk, passed_tests - BOARD_PUBLISH_INTERVAL );
+            if( board ) {
+                uint64_t t = trace_begin();
+                board_publish();
+                trace_end( "board publish", t, passed_tests );
+            }
+            trace_chunk = trace_begin();
+        }
         if( !(passed_tests % 1000000) ) {
+            if( campaign_queue )
+                __atomic_fetch_add( &campaign_queue->fuzzed, 1000000, __ATOMIC_RELAXED );
+            if( !opts->quiet && !opts->board ) {
+                uint64_t t = trace_begin();
+                printf(".");
+                if( !(passed_tests % 10000000) ) {
+                    printf("[ %4lldM tests passed ]\n", passed_tests/1000000 );
+                    profile_report();
+                }
+                fflush(stdout);
+                trace_end( "breadcrumbs", t, passed_tests );
+            }
+        }
+    }
+    if( opts->iterations % BOARD_PUBLISH_INTERVAL )
+        trace_end( "fuzz", trace_chunk, opts->iterations - opts->iterations % BOARD_PUBLISH_INTERVAL );
+    if( profile.pending )
+        profile_add( PROFILE_LOOP, profile.last_end, read_cycle_counter() );
+    if( !opts->quiet ) {
+        uint64_t t = trace_begin();
+        double elapsed = wall_seconds() - t_begin;
+        double cycles_per_sec = elapsed > 0 ? (read_cycle_counter() - cycles_begin) / elapsed : 0.0;
+        fuzz_report( opts, opts->iterations, elapsed, cycles_per_sec );
+        profile_report();
+        trace_end( "report", t, opts->iterations );
+    }
+}
+
+
+
+// ---------------------------------------------------
+//   Deterministic block mode (--threads, --block).
+//   The iterations are cut into blocks of 1M, and
+//   block b draws all its randomness from state
+//   derived from (seed, b) alone, with the stage pools
+//   rebuilt at its start. Threads claim blocks in
+//   order. Per-block statistics are merged in block
+//   order, and an invariant violation ends only its
+//   own block: once one is caught no later blocks are
+//   started, and the violation in the lowest block is
+//   reported. Inputs, findings and statistics are
+//   thus the same for any thread count, and --block=B
+//   replays block B alone.
+//
+//   Real crashes still take the process down at once;
+//   the handler names the block to replay.
+// ---------------------------------------------------
+
+#define FUZZ_BLOCK_ITERATIONS 1000000
+
+struct fuzz_block_stats {
+    uint64_t source_inputs[2];
+    uint64_t source_valid[2];
+    uint64_t poison_checks;
+    uint64_t operand_guard_checks;
+    uint64_t operand_guard_truncated;
+    uint64_t utility_calls;
+    uint64_t tokens_walked;
+    uint64_t token_streams;
+    uint64_t token_cycles;
+    uint64_t hook_calls;
+    uint64_t hooked_formats;
+    uint64_t hooked_format_failures;
+};
+
+
+struct fuzz_block {
+    fuzz_block_stats stats;
+    bool done;
+    bool failed;
+    long long failed_iteration;
+    input_snapshot input;
+    char message[256];
+};
+
+
+struct fuzz_block_run {
+    const fuzzer_options* opts;
+    fuzz_block* blocks;
+    long long first_block;
+    long long block_count;
+    long long next_block;       // claimed in order by the workers
+    long long failed_block;     // lowest block with a finding so far
+};
+
+
+__thread long long current_block = -1;
+__thread long long current_block_iteration = 0;
+
+
+void print_block_context(void) {
+    if( current_block >= 0 )
+        printf("Block %lld, iteration %lld; replay with --block=%lld\n",
+            current_block, current_block_iteration, current_block );
+}
+
+
+static inline uint64_t splitmix64( uint64_t* state ) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+
+void take_thread_stats( fuzz_block_stats* stats ) {
+    int k;
+    for( k=0; k<2; k++ ) {
+        stats->source_inputs[k] = source_inputs[k];
+        stats->source_valid[k]  = source_valid[k];
+        source_inputs[k] = source_valid[k] = 0;
+    }
+    stats->poison_checks = poison_checks;                   poison_checks = 0;
+    stats->operand_guard_checks = operand_guard_checks;     operand_guard_checks = 0;
+    stats->operand_guard_truncated = operand_guard_truncated; operand_guard_truncated = 0;
+    stats->utility_calls = utility_calls;                   utility_calls = 0;
+    stats->tokens_walked = tokens_walked;                   tokens_walked = 0;
+    stats->token_streams = token_streams;                   token_streams = 0;
+    stats->token_cycles  = token_cycles;                    token_cycles = 0;
+    stats->hook_calls    = hook_calls;                      hook_calls = 0;
+    stats->hooked_formats = hooked_formats;                 hooked_formats = 0;
+    stats->hooked_format_failures = hooked_format_failures; hooked_format_failures = 0;
+}
+
+
+void add_thread_stats( const fuzz_block_stats* stats ) {
+    int k;
+    for( k=0; k<2; k++ ) {
+        source_inputs[k] += stats->source_inputs[k];
+        source_valid[k]  += stats->source_valid[k];
+    }
+    poison_checks += stats->poison_checks;
+    operand_guard_checks += stats->operand_guard_checks;
+    operand_guard_truncated += stats->operand_guard_truncated;
+    utility_calls += stats->utility_calls;
+    tokens_walked += stats->tokens_walked;
+    token_streams += stats->token_streams;
+    token_cycles  += stats->token_cycles;
+    hook_calls    += stats->hook_calls;
+    hooked_formats += stats->hooked_formats;
+    hooked_format_failures += stats->hooked_format_failures;
+}
+
+
+void run_fuzz_block( const fuzzer_options* opts, long long block, fuzz_block* out ) {
+    uint64_t trace_block = trace_begin();
+    unsigned int rand_state;
+    uint64_t mix = (uint64_t)opts->seed * 0x9E3779B97F4A7C15ull ^ (uint64_t)block;
+    rand_state = (unsigned int)splitmix64( &mix );
+    thread_rand_state = &rand_state;
+    stage_rng = splitmix64( &mix ) | 1;
+    if( opts->hooks )
+        init_hooked_formatters();
+    int poison_countdown = opts->poison_interval;
+    operand_guard_countdown = opts->operand_guard_interval;
+
+    long long begin = block * FUZZ_BLOCK_ITERATIONS;
+    long long end = begin + FUZZ_BLOCK_ITERATIONS < opts->iterations
+                  ? begin + FUZZ_BLOCK_ITERATIONS : opts->iterations;
+    jmp_buf jump;
+    current_block = block;
+    current_block_iteration = 0;
+    if( thread_crash_ring )
+        thread_crash_ring->block = block;
+    if( setjmp( jump ) ) {
+        out->failed = true;
+        out->failed_iteration = current_block_iteration;
+        out->input = *current_input();
+        memcpy( out->message, finding_message, sizeof(out->message) );
+        thread_findings++;
+    } else {
+        finding_jump = &jump;
+        for( ; current_block_iteration < end - begin; current_block_iteration++ ) {
+            fuzz_iteration( opts, &poison_countdown, false, 0 );
+            if( !((current_block_iteration+1) % BOARD_PUBLISH_INTERVAL) )
+                board_publish();
+        }
+    }
+    board_publish();
+    finding_jump = NULL;
+    current_block = -1;
+    thread_rand_state = NULL;
+    take_thread_stats( &out->stats );
+    out->done = true;
+    trace_end( "block", trace_block, block );
+}
+
+
+void* fuzz_block_worker( void* arg ) {
+    fuzz_block_run* run = (fuzz_block_run*)arg;
+    trace_thread_name( "block worker" );
+    board_claim_slot();
+    crash_record_claim_ring();
+    for(;;) {
+        long long block = __atomic_fetch_add( &run->next_block, 1, __ATOMIC_RELAXED );
+        if( block >= run->first_block + run->block_count
+         || block > __atomic_load_n( &run->failed_block, __ATOMIC_ACQUIRE ) )
+            break;
+        fuzz_block* out = &run->blocks[block - run->first_block];
+        run_fuzz_block( run->opts, block, out );
+        if( out->failed ) {
+            long long lowest = __atomic_load_n( &run->failed_block, __ATOMIC_RELAXED );
+            while( block < lowest
+                && !__atomic_compare_exchange_n( &run->failed_block, &lowest, block, false,
+                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+                ;
+        }
+        if( !run->opts->quiet && !run->opts->board ) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    free( hooked_formatters );
+    hooked_formatters = NULL;
+    return NULL;
+}
+
+
+int run_fuzz_blocks( const fuzzer_options* opts ) {
+    int i;
+    long long b;
+    fuzz_block_run run;
+    long long total_blocks = (opts->iterations + FUZZ_BLOCK_ITERATIONS - 1) / FUZZ_BLOCK_ITERATIONS;
+    run.opts = opts;
+    run.first_block = opts->block >= 0 ? opts->block : 0;
+    run.block_count = opts->block >= 0 ? 1 : total_blocks;
+    run.next_block = run.first_block;
+    run.failed_block = run.first_block + run.block_count;
+    if( run.first_block >= total_blocks ) {
+        printf("Block %lld is beyond the %lld blocks of %lld iterations\n",
+            run.first_block, total_blocks, opts->iterations );
+        return EXIT_FAILURE;
+    }
+    run.blocks = (fuzz_block*)calloc( run.block_count, sizeof(fuzz_block) );
+    crash_context_printer = print_block_context;
+
+    int thread_count = opts->block >= 0 ? 1 : opts->threads;
+    pthread_t* threads = (pthread_t*)calloc( thread_count, sizeof(pthread_t) );
+    double t_begin = wall_seconds();
+    uint64_t cycles_begin = read_cycle_counter();
+    for( i=0; i<thread_count; i++ )
+        pthread_create( &threads[i], NULL, fuzz_block_worker, &run );
+    for( i=0; i<thread_count; i++ )
+        pthread_join( threads[i], NULL );
+    double elapsed = wall_seconds() - t_begin;
+    double cycles_per_sec = elapsed > 0 ? (read_cycle_counter() - cycles_begin) / elapsed : 0.0;
+    free( threads );
+
+    // merge in block order, up to and including the first failure
+    long long iterations = 0;
+    fuzz_block* failure = NULL;
+    for( b=0; b<run.block_count && !failure; b++ ) {
+        fuzz_block* blk = &run.blocks[b];
+        add_thread_stats( &blk->stats );
+        iterations += blk->failed ? blk->failed_iteration + 1 : blk->stats.source_inputs[0] + blk->stats.source_inputs[1];
+        if( blk->failed )
+            failure = blk;
+    }
+    if( !opts->quiet ) {
+        uint64_t t = trace_begin();
+        printf("\n%lld blocks on %d threads", b, thread_count );
+        fuzz_report( opts, iterations, elapsed, cycles_per_sec );
+        trace_end( "report", t, iterations );
+    }
+    if( failure ) {
+        long long block = run.first_block + (failure - run.blocks);
+        printf("\nInvariant violated: %s\n", failure->message );
+        printf("Machine mode: %d (%s)\n", failure->input.machine_mode,
+            machine_mode_name( failure->input.machine_mode ) );
+        printf("Opcode at time of finding:\n");
+        for( i=0; i<16; i++ )
+            printf("%02X ", failure->input.bytes[i] );
+        printf("\nBlock %lld, iteration %lld; replay with --block=%lld\n",
+            block, failure->failed_iteration, block );
+    }
+    free( run.blocks );
+    return failure ? EXIT_FAILURE : 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Digest stream diff (--digest-diff=OLD,NEW). Both
+//   streams are mapped and compared with the SIMD
+//   first_difference() scan; for the differing
+//   iterations, the inputs are regenerated from the
+//   seed and decoded with the library at hand.
+// ---------------------------------------------------
+
+#define MAX_DIGEST_REPORTS 100
+
+struct digest_map {
+    const digest_header* header;
+    const uint64_t* digests;
+    size_t count;
+    size_t size;
+};
+
+
+bool digest_map_open( const char* path, digest_map* map ) {
+    int fd = open( path, O_RDONLY );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) ) {
+        printf("Cannot open digest stream %s: %s\n", path, strerror(errno) );
+        return false;
+    }
+    map->size = (size_t)st.st_size;
+    void* p = map->size >= sizeof(digest_header)
+            ? mmap( NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if( p == MAP_FAILED || ((const digest_header*)p)->magic != DIGEST_MAGIC
+     || ((const digest_header*)p)->version != DIGEST_VERSION ) {
+        printf("%s is not a digest stream\n", path );
+        if( p != MAP_FAILED )
+            munmap( p, map->size );
+        return false;
+    }
+    madvise( p, map->size, MADV_SEQUENTIAL );
+    map->header = (const digest_header*)p;
+    map->digests = (const uint64_t*)(map->header + 1);
+    // the count field is only set on a clean exit; the size is authoritative
+    map->count = (map->size - sizeof(digest_header)) / sizeof(uint64_t);
+    return true;
+}
+
+
+void print_zydis_version( uint64_t v ) {
+    printf("%d.%d.%d.%d", (int)(v >> 48), (int)(v >> 32) & 0xFFFF, (int)(v >> 16) & 0xFFFF, (int)v & 0xFFFF );
+}
+
+
+int run_digest_diff( const fuzzer_options* opts ) {
+    char old_path[PATH_MAX];
+    const char* comma = strchr( opts->digest_diff, ',' );
+    if( !comma || (size_t)(comma - opts->digest_diff) >= sizeof(old_path) ) {
+        printf("--digest-diff expects OLD,NEW\n");
+        return EXIT_FAILURE;
+    }
+    memcpy( old_path, opts->digest_diff, comma - opts->digest_diff );
+    old_path[comma - opts->digest_diff] = 0;
+    digest_map a, b;
+    if( !digest_map_open( old_path, &a ) || !digest_map_open( comma + 1, &b ) )
+        return EXIT_FAILURE;
+    if( a.header->seed != b.header->seed ) {
+        printf("The streams were made with different seeds (%u, %u)\n", a.header->seed, b.header->seed );
+        return EXIT_FAILURE;
+    }
+    printf("Old: %s, Zydis ", old_path );
+    print_zydis_version( a.header->zydis_version );
+    printf(", %zu digests\nNew: %s, Zydis ", a.count, comma + 1 );
+    print_zydis_version( b.header->zydis_version );
+    printf(", %zu digests\n", b.count );
+
+    // first pass: find the differing iterations
+    size_t common = a.count < b.count ? a.count : b.count;
+    size_t reported[MAX_DIGEST_REPORTS];
+    size_t report_count = 0, differences = 0, i = 0;
+    double t_begin = wall_seconds();
+    while( i < common ) {
+        long offset = first_difference( a.digests + i, b.digests + i, (common - i) * sizeof(uint64_t) );
+        if( offset < 0 )
+            break;
+        i += offset / sizeof(uint64_t);
+        if( report_count < MAX_DIGEST_REPORTS )
+            reported[report_count++] = i;
+        differences++;
+        i++;
+    }
+    double elapsed = wall_seconds() - t_begin;
+    printf("%zu of %zu iterations differ (compared %.0f MB/s)\n", differences, common,
+        elapsed > 0 ? 2.0 * common * sizeof(uint64_t) / elapsed / 1e6 : 0.0 );
+    if( a.count != b.count )
+        printf("The streams differ in length; only the first %zu iterations were compared\n", common );
+
+    // second pass: regenerate the reported inputs from the seed
+    if( report_count ) {
+        size_t r = 0, n;
+        srand( a.header->seed );
+        for( n=0; r<report_count; n++ ) {
+            uint8_t buf[64];
+            bool from_seed;
+            int decoder_index = generate_fuzz_input( buf, &from_seed );
+            if( n != reported[r] )
+                continue;
+            r++;
+            ZydisDecodedInstruction instr;
+            ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+            char text[256] = "(invalid)";
+            ZyanStatus status = wrapped_ZydisDecoderDecodeFull( &decoders[decoder_index], buf, 64,
+                &instr, operands, ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+            if( ZYAN_SUCCESS(status) )
+                ZydisFormatterFormatInstruction( &formatter_intel, &instr, operands,
+                    instr.operand_count_visible, text, sizeof(text), 0, NULL );
+            printf("Iteration %-12zu %-12s", n, machine_mode_name( decoders[decoder_index].machine_mode ) );
+            int k;
+            for( k=0; k<(ZYAN_SUCCESS(status) ? instr.length : 16); k++ )
+                printf(" %02X", buf[k] );
+            printf("\n    now: status 0x%08X  %s\n", status, text );
+        }
+    }
+    munmap( (void*)a.header, a.size );
+    munmap( (void*)b.header, b.size );
+    return differences ? EXIT_FAILURE : 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Generator driven by external entropy. With
+//   --entropy-file, one input of an external fuzzer
+//   such as AFL (`--entropy-file=@@`) is turned into
+//   one generated instruction, which runs through the
+//   fuzz iteration and its enabled stages. Built with
+//   ZYDIS_FUZZER_LIBFUZZER, the harness is a libFuzzer
+//   target doing the same for every input, with all
+//   stages enabled.
+// ---------------------------------------------------
+
+void print_entropy_input( const uint8_t* data, size_t size ) {
+    entropy_stream stream;
+    uint8_t buf[64];
+    bool from_seed;
+    int i;
+    entropy_stream_init( &stream, data, size );
+    thread_entropy = &stream;
+    int decoder_index = generate_fuzz_input( buf, &from_seed );
+    thread_entropy = NULL;
+    printf("%d-bit input from %zu entropy bytes:", decoder_bits[decoder_index], size );
+    for( i=0; i<16; i++ )
+        printf(" %02X", buf[i] );
+    printf("\n");
+}
+
+
+void run_entropy_input( const fuzzer_options* opts, const uint8_t* data, size_t size ) {
+    entropy_stream stream;
+    int poison_countdown = opts->poison_interval;
+    entropy_stream_init( &stream, data, size );
+    thread_entropy = &stream;
+    fuzz_iteration( opts, &poison_countdown, false, 0 );
+    thread_entropy = NULL;
+}
+
+
+int run_entropy_file( const fuzzer_options* opts ) {
+    int fd = open( opts->entropy_file, O_RDONLY );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) ) {
+        printf("Cannot open entropy file %s: %s\n", opts->entropy_file, strerror(errno) );
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t* data = (uint8_t*)malloc( size ? size : 1 );
+    if( !data || read( fd, data, size ) != (ssize_t)size ) {
+        printf("Cannot read entropy file %s\n", opts->entropy_file );
+        close( fd );
+        return EXIT_FAILURE;
+    }
+    close( fd );
+    print_entropy_input( data, size );
+    run_entropy_input( opts, data, size );
+    free( data );
+    return 0;
+}
+
+
+#ifdef ZYDIS_FUZZER_LIBFUZZER
+
+fuzzer_options libfuzzer_opts;
+
+extern "C" int LLVMFuzzerInitialize( int* argc, char*** argv ) {
+    (void)argc;
+    (void)argv;
+    memset( &libfuzzer_opts, 0, sizeof(libfuzzer_opts) );
+    libfuzzer_opts.utils = true;
+    libfuzzer_opts.tokens = true;
+    libfuzzer_opts.hooks = true;
+    init_decoders();
+    init_formatters();
+    hook_rebuild_interval = 0;  // the pool is fixed for the whole run
+    seed_stage_rng( 0 );
+    init_hooked_formatters();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size ) {
+    seed_stage_rng( 0 );    // same stage decisions for the same input
+    run_entropy_input( &libfuzzer_opts, data, size );
+    return 0;
+}
+
+#endif
+
+
+
+// ---------------------------------------------------
+//   Differential loop over the --diff-lib libraries,
+//   driven by the same generator as the fuzz loop.
+// ---------------------------------------------------
+
+int run_diff_loop( const fuzzer_options* opts ) {
+    int i;
+    long long n;
+    int lib_count = opts->diff_library_count;
+    diff_library* libs = (diff_library*)calloc( lib_count, sizeof(diff_library) );
+    for( i=0; i<lib_count; i++ ) {
+        if( !diff_library_open( &libs[i], opts->diff_libraries[i] ) )
+            return EXIT_FAILURE;
+    }
+
+    long long diffs = 0;
+    for( n=0; n<opts->iterations; n++ ) {
+        uint8_t buf[64];
+        int decoder_index = rand() & (FUZZ_DECODER_COUNT-1);
+        generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+        record_decoder_input( &decoders[decoder_index], buf );
+
+        for( i=0; i<lib_count; i++ )
+            diff_library_decode( &libs[i], decoder_index, buf );
+
+        for( i=1; i<lib_count; i++ ) {
+            if( !diff_libraries_agree( &libs[0], &libs[i] ) )
+                break;
+        }
+        if( i < lib_count ) {
+            if( ++diffs <= MAX_DIFF_REPORTS ) {
+                int k;
+                printf("\nDifference in %s mode, input:", machine_mode_name( current_input()->machine_mode ) );
+                for( k=0; k<16; k++ )
+                    printf(" %02X", buf[k] );
+                printf("\n");
+                for( i=0; i<lib_count; i++ ) {
+                    printf("  %-40s status 0x%08X len %2d  %s\n",
+                        libs[i].path, libs[i].status, libs[i].length, libs[i].text );
+                }
+                if( diffs == MAX_DIFF_REPORTS )
+                    printf("(further differences are only counted)\n");
+            }
+        }
+
+        long long passed_tests = n+1;
+        if( !(passed_tests % 1000000) && !opts->quiet ) {
+            printf(".");
+            if( !(passed_tests % 10000000) ) {
+                printf("[ %4lldM inputs compared ]\n", passed_tests/1000000 );
+                diff_report( libs, lib_count, diffs, passed_tests );
+            }
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+    diff_report( libs, lib_count, diffs, opts->iterations );
+    return diffs ? EXIT_FAILURE : 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Encoder loop
+// ---------------------------------------------------
+
+void encoder_report( double elapsed ) {
+    printf("%llu encoder requests, %llu encoded (%llu absolute requests), %llu NOP fills, %.0f requests/sec\n",
+        (unsigned long long)encoder_counts.requests, (unsigned long long)encoder_counts.encoded,
+        (unsigned long long)encoder_counts.absolute, (unsigned long long)encoder_counts.nop_fills,
+        elapsed > 0 ? encoder_counts.requests / elapsed : 0.0 );
+    fflush(stdout);
+}
+
+
+int run_encoder_loop( const fuzzer_options* opts ) {
+    long long i;
+    crash_context_printer = print_encoder_request;
+    double t_begin = wall_seconds();
+    for( i=0; i<opts->iterations; i++ ) {
+        run_encoder_iteration();
+
+        long long passed_tests = i+1;
+        if( !(passed_tests % 1000000) && !opts->quiet ) {
             printf(".");
             if( !(passed_tests % 10000000) ) {
-                printf("[ %4dM tests passed ]\n", passed_tests/1000000 );
+                printf("[ %4lldM encoder requests ]\n", passed_tests/1000000 );
+                encoder_report( wall_seconds() - t_begin );
+            }
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+    encoder_report( wall_seconds() - t_begin );
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Concurrency stress driver. Each thread runs
+//   --iterations iterations.
+// ---------------------------------------------------
+
+int run_shared_stress( const fuzzer_options* opts ) {
+    int i;
+    int count = opts->threads;
+    stress_worker* workers = (stress_worker*)aligned_alloc( 64, count * sizeof(stress_worker) );
+    memset( workers, 0, count * sizeof(stress_worker) );
+    printf("Concurrency stress: %d threads sharing %d decoders and 3 formatters\n",
+        count, DECODER_COUNT );
+    fflush(stdout);
+
+    double t_begin = wall_seconds();
+    for( i=0; i<count; i++ ) {
+        workers[i].index = i;
+        workers[i].rand_state = opts->seed + i;
+        workers[i].iterations = opts->iterations;
+        pthread_create( &workers[i].thread, NULL, stress_worker_main, &workers[i] );
+    }
+    uint64_t shared_cycles = 0, private_cycles = 0, decodes = 0;
+    for( i=0; i<count; i++ ) {
+        pthread_join( workers[i].thread, NULL );
+        printf("  thread %2d: %llu decodes, %6.1f cycles shared, %6.1f cycles private\n",
+            i, (unsigned long long)workers[i].decodes,
+            (double)workers[i].shared_cycles / workers[i].decodes,
+            (double)workers[i].private_cycles / workers[i].decodes );
+        shared_cycles  += workers[i].shared_cycles;
+        private_cycles += workers[i].private_cycles;
+        decodes += workers[i].decodes;
+    }
+    double elapsed = wall_seconds() - t_begin;
+    printf("%llu inputs in %.2f s (%.0f inputs/sec), all shared results matched private copies\n",
+        (unsigned long long)decodes, elapsed, elapsed > 0 ? decodes / elapsed : 0.0 );
+    printf("Decode+format cost: %.1f cycles shared, %.1f cycles private (%+.1f%% for sharing)\n",
+        (double)shared_cycles / decodes, (double)private_cycles / decodes,
+        private_cycles ? 100.0 * ((double)shared_cycles - private_cycles) / private_cycles : 0.0 );
+    free( workers );
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Thread-scaling benchmark. The decode loop runs at
+//   1, 2, 4 .. N threads in three layouts:
+//
+//     shared   all threads decode through the global
+//              decoders
+//     packed   per-thread decoder copies and per-thread
+//              counters in adjacent array elements, so
+//              neighbouring threads write to the same
+//              cache lines
+//     padded   the same, with every thread's state on
+//              its own cache lines
+//
+//   The counters are stored to memory on each decode,
+//   as a real fuzzer's statistics would be, so the
+//   packed layout shows what false sharing costs.
+//   Cache misses and, given --perf-raw, a CPU-specific
+//   event such as HITM are counted for each run when
+//   perf_event_open is permitted.
+// ---------------------------------------------------
+
+#define SCALING_INPUTS 1024     // pre-generated inputs per thread
+
+enum scaling_layout { SCALING_SHARED, SCALING_PACKED, SCALING_PADDED, SCALING_LAYOUTS };
+
+const char* scaling_layout_names[SCALING_LAYOUTS] = { "shared", "packed", "padded" };
+
+
+struct scaling_packed_state {
+    ZydisDecoder decoders[DECODER_COUNT];
+    uint64_t decodes;
+    uint64_t valid;
+};
+
+
+struct scaling_padded_state {
+    alignas(64) ZydisDecoder decoders[DECODER_COUNT];
+    uint64_t decodes;
+    uint64_t valid;
+};
+
+
+struct scaling_thread {
+    pthread_t thread;
+    pthread_barrier_t* start;
+    const ZydisDecoder* decoders;
+    uint64_t* decodes;
+    uint64_t* valid;
+    const uint8_t* inputs;          // SCALING_INPUTS * 64 bytes
+    const uint8_t* input_decoders;  // decoder index of each input
+    long long iterations;
+};
+
+
+void* scaling_thread_main( void* arg ) {
+    scaling_thread* t = (scaling_thread*)arg;
+    ZydisDecodedInstruction instr;
+    ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+    uint64_t valid = 0;
+    long long n;
+    pthread_barrier_wait( t->start );
+    for( n=0; n<t->iterations; n++ ) {
+        int k = n & (SCALING_INPUTS-1);
+        ZyanStatus status = ZydisDecoderDecodeFull(
+            &t->decoders[ t->input_decoders[k] ], t->inputs + k*64, 64, &instr, operands,
+            ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        valid += ZYAN_SUCCESS(status);
+        __atomic_store_n( t->decodes, (uint64_t)n + 1, __ATOMIC_RELAXED );
+        __atomic_store_n( t->valid, valid, __ATOMIC_RELAXED );
+    }
+    return NULL;
+}
+
+
+// perf counters, opened once with inherit so that they
+// cover the benchmark threads created afterwards
+
+struct scaling_counter {
+    const char* name;
+    int fd;
+};
+
+
+int open_perf_counter( uint32_t type, uint64_t config ) {
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+
+uint64_t read_perf_counter( int fd ) {
+    uint64_t value = 0;
+    if( read( fd, &value, sizeof(value) ) != sizeof(value) )
+        return 0;
+    return value;
+}
+
+
+int run_bench_scaling( const fuzzer_options* opts ) {
+    int max_threads = opts->bench_scaling;
+    int i, layout, count;
+
+    scaling_counter counters[2] = {
+        { "cache-misses", open_perf_counter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES ) },
+        { "raw-event",    opts->perf_raw ? open_perf_counter( PERF_TYPE_RAW, opts->perf_raw ) : -1 },
+    };
+    if( counters[0].fd < 0 )
+        printf("perf_event_open not permitted, running without cache counters\n");
+
+    // inputs are generated up front so that only decoding is measured
+    uint8_t* inputs = (uint8_t*)malloc( (size_t)max_threads * SCALING_INPUTS * 64 );
+    uint8_t* input_decoders = (uint8_t*)malloc( (size_t)max_threads * SCALING_INPUTS );
+    for( i=0; i<max_threads*SCALING_INPUTS; i++ ) {
+        input_decoders[i] = rand() & (FUZZ_DECODER_COUNT-1);
+        generate_rand_instr( inputs + (size_t)i*64, decoder_bits[input_decoders[i]]==64 );
+    }
+
+    scaling_thread* threads = (scaling_thread*)calloc( max_threads, sizeof(scaling_thread) );
+    scaling_packed_state* packed = (scaling_packed_state*)aligned_alloc( 64,
+        ((max_threads * sizeof(scaling_packed_state) + 63) & ~(size_t)63) );
+    scaling_padded_state* padded = (scaling_padded_state*)aligned_alloc( 64,
+        max_threads * sizeof(scaling_padded_state) );
+
+    printf("Thread scaling, %lld decodes per thread, %d pre-generated inputs per thread\n",
+        opts->iterations, SCALING_INPUTS );
+    printf("layout  threads    decodes/sec  efficiency");
+    for( i=0; i<2; i++ )
+        if( counters[i].fd >= 0 )
+            printf("  %14s/dec", counters[i].name );
+    printf("\n");
+
+    for( layout=0; layout<SCALING_LAYOUTS; layout++ ) {
+        double single_rate = 0;
+        for( count=1; ; count = count*2 < max_threads ? count*2 : max_threads ) {
+            pthread_barrier_t start;
+            pthread_barrier_init( &start, NULL, count + 1 );
+            for( i=0; i<count; i++ ) {
+                scaling_thread* t = &threads[i];
+                t->start = &start;
+                t->inputs = inputs + (size_t)i * SCALING_INPUTS * 64;
+                t->input_decoders = input_decoders + (size_t)i * SCALING_INPUTS;
+                t->iterations = opts->iterations;
+                if( layout == SCALING_SHARED ) {
+                    // the shared layout keeps its counters thread-private
+                    // in padded slots; only the decoders are shared
+                    t->decoders = decoders;
+                    t->decodes = &padded[i].decodes;
+                    t->valid = &padded[i].valid;
+                } else if( layout == SCALING_PACKED ) {
+                    memcpy( packed[i].decoders, decoders, sizeof(decoders) );
+                    t->decoders = packed[i].decoders;
+                    t->decodes = &packed[i].decodes;
+                    t->valid = &packed[i].valid;
+                } else {
+                    memcpy( padded[i].decoders, decoders, sizeof(decoders) );
+                    t->decoders = padded[i].decoders;
+                    t->decodes = &padded[i].decodes;
+                    t->valid = &padded[i].valid;
+                }
+                pthread_create( &t->thread, NULL, scaling_thread_main, t );
+            }
+            for( i=0; i<2; i++ )
+                if( counters[i].fd >= 0 ) {
+                    ioctl( counters[i].fd, PERF_EVENT_IOC_RESET, 0 );
+                    ioctl( counters[i].fd, PERF_EVENT_IOC_ENABLE, 0 );
+                }
+            double t_begin = wall_seconds();
+            pthread_barrier_wait( &start );
+            for( i=0; i<count; i++ )
+                pthread_join( threads[i].thread, NULL );
+            double elapsed = wall_seconds() - t_begin;
+            uint64_t events[2] = { 0, 0 };
+            for( i=0; i<2; i++ )
+                if( counters[i].fd >= 0 ) {
+                    ioctl( counters[i].fd, PERF_EVENT_IOC_DISABLE, 0 );
+                    events[i] = read_perf_counter( counters[i].fd );
+                }
+            pthread_barrier_destroy( &start );
+
+            double decodes = (double)opts->iterations * count;
+            double rate = elapsed > 0 ? decodes / elapsed : 0.0;
+            if( count == 1 )
+                single_rate = rate;
+            double efficiency = single_rate > 0 ? rate / (single_rate * count) : 0.0;
+            printf("%-6s  %7d  %13.0f  %9.1f%%", scaling_layout_names[layout], count, rate, 100.0 * efficiency );
+            for( i=0; i<2; i++ )
+                if( counters[i].fd >= 0 )
+                    printf("  %18.4f", events[i] / decodes );
+            printf("  |");
+            for( i=0; i<(int)(efficiency * 40 + 0.5) && i<40; i++ )
+                printf("#");
+            printf("\n");
+            fflush(stdout);
+            if( count == max_threads )
+                break;
+        }
+    }
+
+    for( i=0; i<2; i++ )
+        if( counters[i].fd >= 0 )
+            close( counters[i].fd );
+    free( padded );
+    free( packed );
+    free( threads );
+    free( input_decoders );
+    free( inputs );
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Generator benchmark (--bench-generators). Input
+//   generation alone, without decoding, for each
+//   generator variant in turn: the built-in generator
+//   on rand() and on rand_r(); the same generator on
+//   an entropy stream filled by a scalar xorshift64*
+//   or by 4-lane SSE2 xorshift32; a structured ModRM
+//   pattern (or the --patterns file); and seed
+//   mutation. Besides inputs/sec, each variant gets a
+//   fingerprint of its input distribution: histograms
+//   of the leading prefix count and of the escape
+//   class after the prefixes, with the total variation
+//   distance to the rand() baseline. A faster variant
+//   at distance ~0 generates the same inputs
+//   statistically.
+// ---------------------------------------------------
+
+enum generator_variant {
+    GENERATOR_RAND,
+    GENERATOR_RAND_R,
+    GENERATOR_XORSHIFT,
+    GENERATOR_SIMD,
+    GENERATOR_PATTERN,
+    GENERATOR_SEEDS,
+    GENERATOR_VARIANTS
+};
+
+static const char* generator_variant_names[GENERATOR_VARIANTS] = {
+    "rand()", "rand_r()", "xorshift stream", "SIMD stream", "ModRM pattern", "seed mutation"
+};
+
+#define GENERATOR_ENTROPY_BYTES 96      // > 64 tail bytes + all decisions
+#define GENERATOR_FINGERPRINT_INPUTS (1 << 20)
+
+volatile uint8_t generator_sink;    // keeps the generated bytes live
+
+struct generator_state {
+    unsigned int rand_state;
+    uint64_t xorshift;
+#if defined(__SSE2__)
+    __m128i lanes;
+#endif
+    alignas(16) uint8_t entropy[GENERATOR_ENTROPY_BYTES];
+};
+
+struct generator_fingerprint {
+    uint64_t prefixes[16];
+    uint64_t escapes[ESCAPE_CLASSES];
+    uint64_t count;
+};
+
+
+void fill_entropy_xorshift( generator_state* st ) {
+    int i;
+    for( i=0; i<GENERATOR_ENTROPY_BYTES; i+=8 ) {
+        st->xorshift ^= st->xorshift >> 12;
+        st->xorshift ^= st->xorshift << 25;
+        st->xorshift ^= st->xorshift >> 27;
+        uint64_t v = st->xorshift * 0x2545F4914F6CDD1Dull;
+        memcpy( st->entropy + i, &v, 8 );
+    }
+}
+
+
+void fill_entropy_simd( generator_state* st ) {
+#if defined(__SSE2__)
+    int i;
+    __m128i x = st->lanes;
+    for( i=0; i<GENERATOR_ENTROPY_BYTES; i+=16 ) {
+        x = _mm_xor_si128( x, _mm_slli_epi32( x, 13 ) );
+        x = _mm_xor_si128( x, _mm_srli_epi32( x, 17 ) );
+        x = _mm_xor_si128( x, _mm_slli_epi32( x, 5 ) );
+        _mm_store_si128( (__m128i*)(st->entropy + i), x );
+    }
+    st->lanes = x;
+#else
+    fill_entropy_xorshift( st );
+#endif
+}
+
+
+static inline int generate_variant( int variant, generator_state* st, uint8_t buf[64] ) {
+    entropy_stream stream;
+    int decoder_index;
+    switch( variant ) {
+        case GENERATOR_RAND:
+            decoder_index = rand() & (FUZZ_DECODER_COUNT-1);
+            generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+            return decoder_index;
+        case GENERATOR_RAND_R:
+            // every decision through rand_r, as in block mode
+            thread_rand_state = &st->rand_state;
+            decoder_index = rand_r( &st->rand_state ) & (FUZZ_DECODER_COUNT-1);
+            generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+            thread_rand_state = NULL;
+            return decoder_index;
+        case GENERATOR_XORSHIFT:
+        case GENERATOR_SIMD:
+            if( variant == GENERATOR_XORSHIFT )
+                fill_entropy_xorshift( st );
+            else
+                fill_entropy_simd( st );
+            entropy_stream_init( &stream, st->entropy, GENERATOR_ENTROPY_BYTES );
+            thread_entropy = &stream;
+            decoder_index = entropy_bits( 2 );
+            generate_rand_instr( buf, decoder_bits[decoder_index]==64 );
+            thread_entropy = NULL;
+            return decoder_index;
+        case GENERATOR_PATTERN:
+            return generate_pattern_input( buf );
+        default:
+            return generate_seed_mutation( buf );
+    }
+}
+
+
+void fingerprint_input( generator_fingerprint* fp, const uint8_t* buf ) {
+    fp->prefixes[prefix_count( buf )]++;
+    fp->escapes[escape_class_of( buf )]++;
+    fp->count++;
+}
+
+
+// Total variation distance of two histograms, 0 to 1.
+
+double histogram_distance( const uint64_t* a, uint64_t a_count, const uint64_t* b, uint64_t b_count, int buckets ) {
+    double d = 0;
+    int i;
+    if( !a_count || !b_count )
+        return 1.0;
+    for( i=0; i<buckets; i++ ) {
+        double x = (double)a[i] / a_count - (double)b[i] / b_count;
+        d += x < 0 ? -x : x;
+    }
+    return d / 2;
+}
+
+
+int run_bench_generators( const fuzzer_options* opts ) {
+    int variant, i;
+    long long n;
+    static generator_fingerprint fingerprints[GENERATOR_VARIANTS];
+    bool available[GENERATOR_VARIANTS];
+    const char* pattern_name = "ModRM pattern";
+
+    if( !patterns ) {
+        // ModRM-structured encodings with optional prefixes,
+        // escape, SIB, displacement and immediate
+        char error[160];
+        patterns = (pattern_set*)calloc( 1, sizeof(pattern_set) );
+        if( !compile_pattern_line( "[legacy]? [legacy]? [rex]? 0F? [op] [modrm] [sib]? disp8? imm8?",
+                                   error, sizeof(error) ) ) {
+            printf("Built-in benchmark pattern: %s\n", error );
+            return EXIT_FAILURE;
+        }
+        build_pattern_picks();
+    } else {
+        pattern_name = "--patterns";
+    }
+    if( !seed_count )
+        synthesize_seeds();
+    for( variant=0; variant<GENERATOR_VARIANTS; variant++ )
+        available[variant] = variant != GENERATOR_SEEDS || seed_count;
+
+    printf("Generator benchmark, %lld inputs per variant\n", opts->iterations );
+    printf("%-16s %13s %12s %10s %10s\n", "generator", "inputs/sec", "cycles/input", "prefix TVD", "escape TVD" );
+    for( variant=0; variant<GENERATOR_VARIANTS; variant++ ) {
+        generator_state st;
+        uint8_t buf[64];
+        uint8_t sink = 0;
+        generator_fingerprint* fp = &fingerprints[variant];
+        if( !available[variant] ) {
+            printf("%-16s (no seeds)\n", generator_variant_names[variant] );
+            continue;
+        }
+        srand( opts->seed );
+        st.rand_state = opts->seed;
+        st.xorshift = 0x9E3779B97F4A7C15ull ^ opts->seed;
+#if defined(__SSE2__)
+        st.lanes = _mm_set_epi32( 0x2545F491, 0x6C078965, 0x1B873593, (int)(opts->seed | 1) );
+#endif
+
+        double t_begin = wall_seconds();
+        uint64_t cycles_begin = read_cycle_counter();
+        for( n=0; n<opts->iterations; n++ ) {
+            sink += (uint8_t)generate_variant( variant, &st, buf );
+            sink ^= buf[0] ^ buf[63];
+        }
+        uint64_t cycles = read_cycle_counter() - cycles_begin;
+        double elapsed = wall_seconds() - t_begin;
+        generator_sink = sink;
+
+        // fingerprint on a separate pass, outside the timing
+        for( n=0; n<GENERATOR_FINGERPRINT_INPUTS; n++ ) {
+            generate_variant( variant, &st, buf );
+            fingerprint_input( fp, buf );
+        }
+        const generator_fingerprint* base = &fingerprints[GENERATOR_RAND];
+        printf("%-16s %13.0f %12.1f %10.4f %10.4f\n",
+            variant == GENERATOR_PATTERN ? pattern_name : generator_variant_names[variant],
+            elapsed > 0 ? opts->iterations / elapsed : 0.0,
+            opts->iterations ? (double)cycles / opts->iterations : 0.0,
+            histogram_distance( fp->prefixes, fp->count, base->prefixes, base->count, 16 ),
+            histogram_distance( fp->escapes, fp->count, base->escapes, base->count, ESCAPE_CLASSES ) );
+    }
+
+    printf("\nPrefix count histogram (%% of %d inputs)\n%-16s", GENERATOR_FINGERPRINT_INPUTS, "prefixes" );
+    for( i=0; i<16; i++ )
+        printf(" %5d", i );
+    printf("\n");
+    for( variant=0; variant<GENERATOR_VARIANTS; variant++ ) {
+        const generator_fingerprint* fp = &fingerprints[variant];
+        if( !fp->count )
+            continue;
+        printf("%-16s", variant == GENERATOR_PATTERN ? pattern_name : generator_variant_names[variant] );
+        for( i=0; i<16; i++ )
+            printf(" %5.1f", 100.0 * fp->prefixes[i] / fp->count );
+        printf("\n");
+    }
+    printf("\nEscape class histogram (%%)\n%-16s", "escape" );
+    for( i=0; i<ESCAPE_CLASSES; i++ )
+        printf(" %6s", escape_class_names[i] );
+    printf("\n");
+    for( variant=0; variant<GENERATOR_VARIANTS; variant++ ) {
+        const generator_fingerprint* fp = &fingerprints[variant];
+        if( !fp->count )
+            continue;
+        printf("%-16s", variant == GENERATOR_PATTERN ? pattern_name : generator_variant_names[variant] );
+        for( i=0; i<ESCAPE_CLASSES; i++ )
+            printf(" %6.1f", 100.0 * fp->escapes[i] / fp->count );
+        printf("\n");
+    }
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Corpus distillation. Corpus files are flat arrays
+//   of input_record, as written by --save-corpus on any
+//   number of nodes. All files are merged and deduped
+//   in one streaming pass over their mappings, the
+//   unique inputs are decoded in parallel to extract
+//   the same features the novelty feedback uses, and a
+//   lazy greedy set cover picks a small subset that
+//   still covers every feature seen.
+//
+//   Features are hashed to 24 bits here, 16x the
+//   resolution of the novelty bitmap, so that fewer of
+//   them collide and get lost from the cover.
+// ---------------------------------------------------
+
+#define DISTILL_FEATURE_BITS 24
+#define DISTILL_MAX_FEATURES 2
+
+struct distill_input {
+    const input_record* record;
+    uint32_t features[DISTILL_MAX_FEATURES];
+    uint8_t feature_count;
+    uint8_t length;         // decoded length; 16 if decoding failed
+};
+
+
+static inline uint32_t distill_feature_hash( uint64_t feature ) {
+    feature *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(feature >> (64 - DISTILL_FEATURE_BITS));
+}
+
+
+static inline uint64_t record_key_hash( const input_record* rec ) {
+    uint64_t a, b;
+    memcpy( &a, rec->bytes, 8 );
+    memcpy( &b, rec->bytes + 8, 8 );
+    uint64_t h = (a ^ ((uint64_t)rec->decoder_index << 56)) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 29) ^ b) * 0xBF58476D1CE4E5B9ull;
+    return h ^ (h >> 32);
+}
+
+
+static inline bool record_key_equal( const input_record* a, const input_record* b ) {
+    return a->decoder_index == b->decoder_index && !memcmp( a->bytes, b->bytes, 16 );
+}
+
+
+struct distill_worker {
+    pthread_t thread;
+    distill_input* inputs;
+    size_t count;
+};
+
+
+void* distill_worker_main( void* arg ) {
+    distill_worker* w = (distill_worker*)arg;
+    size_t i;
+    for( i=0; i<w->count; i++ ) {
+        distill_input* in = &w->inputs[i];
+        uint8_t buf[64];
+        memset( buf, 0, sizeof(buf) );
+        memcpy( buf, in->record->bytes, 16 );
+        ZydisDecodedInstruction instr;
+        ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT_VISIBLE];
+        ZyanStatus status = wrapped_ZydisDecoderDecodeFull(
+            &decoders[in->record->decoder_index], buf, 64, &instr, operands,
+            ZYDIS_MAX_OPERAND_COUNT_VISIBLE, ZYDIS_DFLAG_VISIBLE_OPERANDS_ONLY );
+        in->feature_count = 0;
+        in->features[in->feature_count++] = distill_feature_hash(
+            behavior_feature( in->record->decoder_index, status, &instr ) );
+        if( ZYAN_SUCCESS(status) ) {
+            in->features[in->feature_count++] = distill_feature_hash(
+                length_feature( in->record->decoder_index, &instr ) );
+            in->length = instr.length;
+        } else {
+            in->length = 16;
+        }
+    }
+    return NULL;
+}
+
+
+// Max-heap of (gain, input) for the lazy greedy cover. Ties
+// go to the shorter input, then to the earlier one, so the
+// result depends only on the input files and their order.
+
+struct cover_entry {
+    uint32_t gain;
+    uint32_t index;
+};
+
+
+static inline bool cover_before( const cover_entry* a, const cover_entry* b, const distill_input* inputs ) {
+    if( a->gain != b->gain )
+        return a->gain > b->gain;
+    if( inputs[a->index].length != inputs[b->index].length )
+        return inputs[a->index].length < inputs[b->index].length;
+    return a->index < b->index;
+}
+
+
+void cover_sift_down( cover_entry* heap, size_t count, size_t i, const distill_input* inputs ) {
+    for(;;) {
+        size_t best = i, l = 2*i+1, r = 2*i+2;
+        if( l < count && cover_before( &heap[l], &heap[best], inputs ) )
+            best = l;
+        if( r < count && cover_before( &heap[r], &heap[best], inputs ) )
+            best = r;
+        if( best == i )
+            return;
+        cover_entry t = heap[i];
+        heap[i] = heap[best];
+        heap[best] = t;
+        i = best;
+    }
+}
+
+
+static inline bool feature_covered( const uint64_t* covered, uint32_t f ) {
+    return (covered[f >> 6] >> (f & 63)) & 1;
+}
+
+
+uint32_t uncovered_gain( const distill_input* in, const uint64_t* covered ) {
+    uint32_t gain = 0;
+    int k;
+    for( k=0; k<in->feature_count; k++ ) {
+        int j;
+        bool repeated = false;
+        for( j=0; j<k; j++ )
+            repeated |= in->features[j] == in->features[k];
+        gain += !repeated && !feature_covered( covered, in->features[k] );
+    }
+    return gain;
+}
+
+
+int run_distill( const fuzzer_options* opts ) {
+    int f;
+    size_t i;
+    double t_begin = wall_seconds();
+    if( !opts->corpus_count ) {
+        printf("--distill needs at least one --corpus=FILE\n");
+        return EXIT_FAILURE;
+    }
+
+    // map all corpus files; the mappings stay alive until the
+    // output is written, and the unique inputs point into them
+    const input_record* maps[MAX_CORPUS_FILES];
+    size_t map_counts[MAX_CORPUS_FILES];
+    size_t total = 0;
+    for( f=0; f<opts->corpus_count; f++ ) {
+        maps[f] = NULL;
+        map_counts[f] = 0;
+        int fd = open( opts->corpus_files[f], O_RDONLY );
+        struct stat st;
+        if( fd < 0 || fstat( fd, &st ) ) {
+            printf("Cannot open corpus %s: %s\n", opts->corpus_files[f], strerror(errno) );
+            return EXIT_FAILURE;
+        }
+        size_t count = (size_t)st.st_size / sizeof(input_record);
+        if( (size_t)st.st_size % sizeof(input_record) )
+            printf("%s: ignoring %d trailing bytes\n", opts->corpus_files[f],
+                (int)((size_t)st.st_size % sizeof(input_record)) );
+        if( count ) {
+            void* p = mmap( NULL, count * sizeof(input_record), PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( p == MAP_FAILED ) {
+                printf("Cannot map corpus %s: %s\n", opts->corpus_files[f], strerror(errno) );
+                close( fd );
+                return EXIT_FAILURE;
+            }
+            madvise( p, count * sizeof(input_record), MADV_SEQUENTIAL );
+            maps[f] = (const input_record*)p;
+            map_counts[f] = count;
+            total += count;
+        }
+        close( fd );
+    }
+
+    // streaming dedupe into an open-addressing table of
+    // indices into the unique input array
+    size_t table_size = 16;
+    while( table_size < 2*total )
+        table_size *= 2;
+    uint32_t* table = (uint32_t*)malloc( table_size * sizeof(uint32_t) );
+    memset( table, 0xFF, table_size * sizeof(uint32_t) );
+    distill_input* inputs = (distill_input*)calloc( total ? total : 1, sizeof(distill_input) );
+    size_t unique = 0, skipped = 0;
+    for( f=0; f<opts->corpus_count; f++ ) {
+        for( i=0; i<map_counts[f]; i++ ) {
+            const input_record* rec = &maps[f][i];
+            if( rec->decoder_index >= DECODER_COUNT ) {
+                skipped++;
+                continue;
+            }
+            size_t slot = record_key_hash( rec ) & (table_size-1);
+            while( table[slot] != 0xFFFFFFFFu && !record_key_equal( inputs[table[slot]].record, rec ) )
+                slot = (slot+1) & (table_size-1);
+            if( table[slot] == 0xFFFFFFFFu ) {
+                table[slot] = (uint32_t)unique;
+                inputs[unique++].record = rec;
+            }
+        }
+    }
+    free( table );
+    double t_merged = wall_seconds();
+
+    // parallel feature extraction over contiguous chunks
+    int thread_count = opts->threads;
+    distill_worker* workers = (distill_worker*)calloc( thread_count, sizeof(distill_worker) );
+    size_t chunk = (unique + thread_count - 1) / thread_count;
+    for( f=0; f<thread_count; f++ ) {
+        size_t begin = f * chunk < unique ? f * chunk : unique;
+        size_t end = begin + chunk < unique ? begin + chunk : unique;
+        workers[f].inputs = inputs + begin;
+        workers[f].count = end - begin;
+        pthread_create( &workers[f].thread, NULL, distill_worker_main, &workers[f] );
+    }
+    for( f=0; f<thread_count; f++ )
+        pthread_join( workers[f].thread, NULL );
+    free( workers );
+    double t_extracted = wall_seconds();
+
+    // lazy greedy set cover: gains only ever shrink, so an entry
+    // whose recomputed gain still beats the next best is optimal
+    uint64_t* covered = (uint64_t*)calloc( (1u << DISTILL_FEATURE_BITS) / 64, sizeof(uint64_t) );
+    cover_entry* heap = (cover_entry*)malloc( (unique ? unique : 1) * sizeof(cover_entry) );
+    size_t heap_count = 0;
+    for( i=0; i<unique; i++ ) {
+        heap[heap_count].gain = uncovered_gain( &inputs[i], covered );
+        heap[heap_count].index = (uint32_t)i;
+        heap_count++;
+    }
+    for( i=heap_count/2; i-->0; )
+        cover_sift_down( heap, heap_count, i, inputs );
+
+    int out = open( opts->distill_output, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    if( out < 0 ) {
+        printf("Cannot create %s: %s\n", opts->distill_output, strerror(errno) );
+        return EXIT_FAILURE;
+    }
+    size_t selected = 0, features = 0;
+    while( heap_count && heap[0].gain ) {
+        uint32_t gain = uncovered_gain( &inputs[heap[0].index], covered );
+        if( gain != heap[0].gain ) {
+            heap[0].gain = gain;
+            cover_sift_down( heap, heap_count, 0, inputs );
+            continue;
+        }
+        const distill_input* in = &inputs[heap[0].index];
+        int k;
+        for( k=0; k<in->feature_count; k++ )
+            covered[in->features[k] >> 6] |= 1ull << (in->features[k] & 63);
+        features += gain;
+        if( write( out, in->record, sizeof(input_record) ) != sizeof(input_record) ) {
+            printf("Cannot write %s: %s\n", opts->distill_output, strerror(errno) );
+            close( out );
+            return EXIT_FAILURE;
+        }
+        selected++;
+        heap[0] = heap[--heap_count];
+        cover_sift_down( heap, heap_count, 0, inputs );
+    }
+    close( out );
+    double t_end = wall_seconds();
+
+    printf("Read %zu records from %d corpus files, %zu unique", total, opts->corpus_count, unique );
+    if( skipped )
+        printf(", %zu with an invalid decoder skipped", skipped );
+    printf("\n");
+    printf("Distilled to %zu inputs covering %zu features, written to %s\n",
+        selected, features, opts->distill_output );
+    printf("Merge %.2f s, feature extraction %.2f s (%d threads), cover %.2f s\n",
+        t_merged - t_begin, t_extracted - t_merged, thread_count, t_end - t_extracted );
+
+    free( heap );
+    free( covered );
+    free( inputs );
+    for( f=0; f<opts->corpus_count; f++ )
+        if( maps[f] )
+            munmap( (void*)maps[f], map_counts[f] * sizeof(input_record) );
+    return 0;
+}
+
+
+
+// ---------------------------------------------------
+//   Campaign supervisor: forks the fast workers,
+//   spawns the sanitizer replayers, restarts any
+//   worker that dies, and reports progress.
+// ---------------------------------------------------
+
+pid_t spawn_fast_worker( const fuzzer_options* opts, replay_queue* q, unsigned int seed ) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if( pid == 0 ) {
+        fuzzer_options worker_opts = *opts;
+        worker_opts.quiet = true;
+        worker_opts.profile_interval = 0;
+        srand( seed );
+        seed_stage_rng( seed );
+        campaign_queue = q;
+        novelty = (novelty_state*)calloc( 1, sizeof(novelty_state) );
+        if( opts->board ) {
+            board = NULL;   // the supervisor's, if any
+            board_create( "campaign worker" );
+            board_claim_slot();
+        }
+        if( opts->crash_record_path ) {
+            char path[PATH_MAX];
+            worker_crash_record_path( path, sizeof(path), opts->crash_record_path, (int)getpid() );
+            if( crash_record_create( path ) )
+                crash_record_claim_ring();
+        }
+        run_fuzz_loop( &worker_opts );
+        board_close();
+        crash_record_close();
+        _exit( 0 );
+    }
+    return pid;
+}
+
+
+pid_t spawn_sanitizer_worker( const char* binary, const char* queue_name, const char* crash_record_path ) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if( pid == 0 ) {
+        // Make every sanitizer report fatal, and route it through
+        // SIGABRT so that the replayed input is printed.
+        setenv( "ASAN_OPTIONS",  "abort_on_error=1", 0 );
+        setenv( "UBSAN_OPTIONS", "halt_on_error=1:abort_on_error=1:print_stacktrace=1", 0 );
+        setenv( "MSAN_OPTIONS",  "abort_on_error=1", 0 );
+        char queue_arg[128];
+        snprintf( queue_arg, sizeof(queue_arg), "--replay-queue=%s", queue_name );
+        if( crash_record_path ) {
+            char record_arg[PATH_MAX + 32];
+            char path[PATH_MAX];
+            worker_crash_record_path( path, sizeof(path), crash_record_path, (int)getpid() );
+            snprintf( record_arg, sizeof(record_arg), "--crash-record=%s", path );
+            execl( binary, binary, queue_arg, record_arg, (char*)NULL );
+        } else {
+            execl( binary, binary, queue_arg, (char*)NULL );
+        }
+        printf("Cannot execute %s: %s\n", binary, strerror(errno) );
+        fflush(stdout);
+        _exit( 127 );
+    }
+    return pid;
+}
+
+
+int run_campaign( const fuzzer_options* opts ) {
+    int i;
+    char queue_name[64];
+    snprintf( queue_name, sizeof(queue_name), "/zydis-fuzz-queue-%d", (int)getpid() );
+    replay_queue* q = replay_queue_map( queue_name, true );
+    if( !q )
+        return EXIT_FAILURE;
+
+    int fast_count = opts->campaign_fast_workers;
+    int san_count  = opts->campaign_sanitizer_workers;
+    pid_t* fast_pids = (pid_t*)calloc( fast_count, sizeof(pid_t) );
+    pid_t* san_pids  = (pid_t*)calloc( san_count + 1, sizeof(pid_t) );
+    unsigned int next_seed = opts->seed;
+
+    for( i=0; i<fast_count; i++ ) {
+        printf("Fast worker %d: seed %u\n", i, next_seed );
+        fast_pids[i] = spawn_fast_worker( opts, q, next_seed++ );
+    }
+    for( i=0; i<san_count; i++ ) {
+        const char* binary = opts->replay_binaries[i % opts->replay_binary_count];
+        printf("Sanitizer worker %d: %s\n", i, binary );
+        san_pids[i] = spawn_sanitizer_worker( binary, queue_name, opts->crash_record_path );
+    }
+    fflush(stdout);
+
+    int fast_running = fast_count;
+    int san_running = san_count;
+    int failures = 0;
+    double t_report = wall_seconds();
+    while( fast_running || san_running ) {
+        int wstatus;
+        pid_t pid = waitpid( -1, &wstatus, WNOHANG );
+        if( pid > 0 ) {
+            bool clean_exit = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+            if( opts->crash_record_path ) {
+                // the record of a dead worker tells its last inputs even
+                // after SIGKILL; it is kept, the others are removed
+                char path[PATH_MAX];
+                worker_crash_record_path( path, sizeof(path), opts->crash_record_path, (int)pid );
+                if( clean_exit )
+                    unlink( path );
+                else if( !access( path, R_OK ) ) {
+                    printf("Worker %d died; its crash record %s:\n", (int)pid, path );
+                    print_postmortem( path );
+                }
+            }
+            for( i=0; i<fast_count; i++ ) {
+                if( fast_pids[i] != pid )
+                    continue;
+                if( clean_exit ) {
+                    fast_pids[i] = 0;
+                    if( !--fast_running )
+                        __atomic_store_n( &q->closing, 1, __ATOMIC_RELEASE );
+                } else {
+                    failures++;
+                    printf("Fast worker %d died (status 0x%x); restarting with seed %u\n",
+                        i, wstatus, next_seed );
+                    fast_pids[i] = spawn_fast_worker( opts, q, next_seed++ );
+                }
             }
+            for( i=0; i<san_count; i++ ) {
+                if( san_pids[i] != pid )
+                    continue;
+                const char* binary = opts->replay_binaries[i % opts->replay_binary_count];
+                if( clean_exit ) {
+                    // queue drained after fuzzing ended
+                    san_pids[i] = 0;
+                    san_running--;
+                } else {
+                    failures++;
+                    printf("Sanitizer worker %d (%s) died (status 0x%x); restarting\n",
+                        i, binary, wstatus );
+                    san_pids[i] = spawn_sanitizer_worker( binary, queue_name, opts->crash_record_path );
+                }
+            }
+            fflush(stdout);
+            continue;
+        }
+        if( pid < 0 && errno == ECHILD )
+            break;
+        usleep( 100000 );
+        if( wall_seconds() - t_report >= 10.0 ) {
+            t_report = wall_seconds();
+            printf("[ %5lluM fuzzed, %llu queued, %llu replayed, %llu dropped ]\n",
+                (unsigned long long)__atomic_load_n( &q->fuzzed, __ATOMIC_RELAXED ) / 1000000,
+                (unsigned long long)__atomic_load_n( &q->head, __ATOMIC_RELAXED ),
+                (unsigned long long)__atomic_load_n( &q->replayed, __ATOMIC_RELAXED ),
+                (unsigned long long)__atomic_load_n( &q->dropped, __ATOMIC_RELAXED ) );
             fflush(stdout);
         }
     }
+    printf("Campaign finished: %lluM fuzzed, %llu queued, %llu replayed, %llu dropped, %d worker failures\n",
+        (unsigned long long)q->fuzzed / 1000000, (unsigned long long)q->head,
+        (unsigned long long)q->replayed, (unsigned long long)q->dropped, failures );
+    shm_unlink( queue_name );
+    return failures ? EXIT_FAILURE : 0;
+}
+
+
+
+// --------------------------
+//   Fuzzer main function
+// --------------------------
+
+#ifndef ZYDIS_FUZZER_LIBFUZZER
+
+int main( int argc, char *argv[] ) {
+
+    fuzzer_options opts;
+    if( parse_options( argc, argv, &opts ) )
+        return EXIT_FAILURE;
+    if( opts.postmortem_path )
+        return print_postmortem( opts.postmortem_path );
+    srand( opts.seed );
+    seed_stage_rng( opts.seed );
+    install_sigabrt_handler();
+    profile_init( opts.profile_interval );
+
+
+    // --------------------------------------
+    //   Prepare Zydis instruction decoders
+    // --------------------------------------
+
+    init_decoders();
+    init_formatters();
+    if( opts.hooks )
+        init_hooked_formatters();
+    if( opts.seeds )
+        synthesize_seeds();
+    if( opts.patterns_file && !load_patterns( opts.patterns_file ) )
+        return EXIT_FAILURE;
+
+    if( opts.digest_diff )
+        return run_digest_diff( &opts );
+    if( opts.entropy_file )
+        return run_entropy_file( &opts );
+    if( opts.digest_out && (opts.seeds || opts.patterns_file || opts.fuzz_blocks || opts.campaign_fast_workers) ) {
+        // seed corpora come from the local encoder, a pattern file is
+        // not recorded in the header so --digest-diff could not rebuild
+        // the inputs, and the other modes do not produce one ordered stream
+        printf("--digest-out works with the plain fuzz loop only, without --seeds or --patterns\n");
+        return EXIT_FAILURE;
+    }
+    if( opts.replay_queue_name ) {
+        if( opts.crash_record_path && crash_record_create( opts.crash_record_path ) )
+            crash_record_claim_ring();
+        int result = run_replay_worker( opts.replay_queue_name );
+        crash_record_close();
+        return result;
+    }
+    if( opts.distill_output )
+        return run_distill( &opts );
+    if( opts.save_corpus ) {
+        corpus_fd = open( opts.save_corpus, O_WRONLY|O_CREAT|O_APPEND, 0644 );
+        if( corpus_fd < 0 ) {
+            printf("Cannot open corpus %s: %s\n", opts.save_corpus, strerror(errno) );
+            return EXIT_FAILURE;
+        }
+    }
+    if( opts.campaign_fast_workers ) {
+        if( opts.objdump_interval || opts.hw_interval || opts.stack_depth_interval ) {
+            printf("--objdump, --hw-oracle and --stack-depth are not supported with --campaign\n");
+            return EXIT_FAILURE;
+        }
+        return run_campaign( &opts );
+    }
+    if( opts.diff_library_count )
+        return run_diff_loop( &opts );
+    if( opts.encoder )
+        return run_encoder_loop( &opts );
+    if( opts.shared_stress )
+        return run_shared_stress( &opts );
+    if( opts.bench_scaling )
+        return run_bench_scaling( &opts );
+    if( opts.bench_generators )
+        return run_bench_generators( &opts );
+
+    if( opts.trace_path )
+        trace_start();
+    if( opts.fuzz_blocks ) {
+        if( opts.save_corpus || opts.objdump_interval || opts.hw_interval || opts.stack_depth_interval ) {
+            printf("--save-corpus, --objdump, --hw-oracle and --stack-depth are not supported with --threads or --block\n");
+            return EXIT_FAILURE;
+        }
+        if( opts.profile_interval )
+            printf("--profile is ignored with --threads or --block\n");
+        if( opts.board )
+            board_create( opts.block >= 0 ? "block replay" : "fuzz threads" );
+        if( opts.crash_record_path && !crash_record_create( opts.crash_record_path ) )
+            return EXIT_FAILURE;
+        int result = run_fuzz_blocks( &opts );
+        crash_record_close();
+        if( opts.trace_path )
+            trace_write( opts.trace_path );
+        if( result && board )
+            board->state = BOARD_CRASHED;   // keep the finding visible
+        else
+            board_close();
+        return result;
+    }
+
+    if( opts.save_corpus )
+        novelty = (novelty_state*)calloc( 1, sizeof(novelty_state) );
+    if( opts.board && board_create( "fuzz" ) )
+        board_claim_slot();
+    if( opts.crash_record_path ) {
+        if( !crash_record_create( opts.crash_record_path ) )
+            return EXIT_FAILURE;
+        crash_record_claim_ring();
+    }
+    if( opts.digest_out && !digest_stream_open( opts.digest_out, opts.seed ) )
+        return EXIT_FAILURE;
+    if( opts.objdump_interval )
+        init_objdump_oracle( opts.objdump_interval );
+    if( opts.hw_interval )
+        init_hw_oracle( opts.hw_interval );
+    if( opts.stack_depth_interval )
+        init_stack_depth( opts.stack_depth_interval );
+    run_fuzz_loop( &opts );
+    digest_stream_close();
+    board_close();
+    crash_record_close();
+    if( opts.trace_path )
+        trace_write( opts.trace_path );
     return 0;
 }
 
+#endif